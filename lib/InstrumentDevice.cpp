@@ -14,6 +14,7 @@
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/SmallPtrSet.h"
 
@@ -59,16 +60,7 @@ namespace cuprof {
 
   
     struct TraceInfoValues {
-      Value* alloc;
-      Value* commit;
-      Value* flushed;
-      Value* signal;
-      Value* records;
-      Value* grid;
-      Value* cta_serial;
-      Value* warpv;
-      Value* lane;
-      Value* kernel;
+      Value* ctx; // trace_ctx_t* of the thread
       Value* filter_sm;
       Value* filter_warpp;
       Value* filter_sm_count;
@@ -90,12 +82,17 @@ namespace cuprof {
     Type* trace_base_info_ty = nullptr;
     Type* trace_info_ty = nullptr;
     Type* trace_info_pty = nullptr;
+    Type* trace_ctx_ty = nullptr;
+    Type* trace_ctx_pty = nullptr;
   
     FunctionType* i32_fty = nullptr;
     FunctionType* i64_fty = nullptr;
 
     FunctionCallee trace_call = nullptr;
+    FunctionCallee trace_sector_call = nullptr;
+    FunctionCallee trace_thread_call = nullptr;
     FunctionCallee trace_ret_call = nullptr;
+    FunctionCallee aggregate_call = nullptr;
     FunctionCallee filter_call = nullptr;
     FunctionCallee filter_volatile_call = nullptr;
 
@@ -123,36 +120,56 @@ namespace cuprof {
       //trace_base_info_ty = getTraceBaseInfoType(ctx);
       trace_info_ty = getTraceInfoType(ctx);
       trace_info_pty = trace_info_ty->getPointerTo();
+      trace_ctx_ty = getTraceCtxType(ctx);
+      trace_ctx_pty = trace_ctx_ty->getPointerTo();
     }
   
     void findOrInsertRuntimeFunctions(Module& module) {
     
       trace_call =
         module.getOrInsertFunction("___cuprof_trace", void_ty,
-                                   i32p_ty, i32p_ty,
-                                   i32p_ty, i32p_ty,
-                                   i8p_ty, i64_ty,
-                                   i64_ty, i64_ty,
-                                   i32_ty, i32_ty,
-                                   i32_ty, i32_ty,
-                                   i32_ty, i32_ty,
-                                   i8_ty);
+                                   trace_ctx_pty, i64_ty,
+                                   i32_ty, i8_ty);
       if (!trace_call.getCallee()) {
         report_fatal_error("No ___cuprof_trace declaration found");
       }
     
+      trace_sector_call =
+        module.getOrInsertFunction("___cuprof_trace_sector",
+                                   trace_call.getFunctionType());
+      if (!trace_sector_call.getCallee()) {
+        report_fatal_error("No ___cuprof_trace_sector declaration found");
+      }
+    
+      trace_thread_call =
+        module.getOrInsertFunction("___cuprof_trace_thread", void_ty,
+                                   trace_ctx_pty,
+                                   i32_ty, i8_ty);
+      if (!trace_thread_call.getCallee()) {
+        report_fatal_error("No ___cuprof_trace_thread declaration found");
+      }
+    
       trace_ret_call =
         module.getOrInsertFunction("___cuprof_trace_ret", void_ty,
-                                   i32p_ty, i32p_ty,
-                                   i32_ty);
+                                   trace_ctx_pty);
       if (!trace_ret_call.getCallee()) {
         report_fatal_error("No ___cuprof_trace declaration found");
       }
     
+      aggregate_call =
+        module.getOrInsertFunction("___cuprof_aggregate", void_ty,
+                                   trace_ctx_pty, i64_ty,
+                                   i32_ty, i32_ty,
+                                   i8_ty);
+      if (!aggregate_call.getCallee()) {
+        report_fatal_error("No ___cuprof_aggregate declaration found");
+      }
+    
       filter_call =
         module.getOrInsertFunction("___cuprof_filter", void_ty,
                                    i8p_ty, i64p_ty, i64p_ty, i32p_ty,
-                                   i8_ty, i8_ty, i8_ty, i64_ty, i32_ty);
+                                   i8_ty, i8_ty, i8_ty, i64_ty, i32_ty,
+                                   i8p_ty, i32_ty, i32_ty);
       if (!filter_call.getCallee()) {
         report_fatal_error("No ___cuprof_filter declaration found");
       }
@@ -413,10 +430,12 @@ namespace cuprof {
 
 
     void insertFilterVolatile(IRBuilder<>& irb, Value** to_be_traced_p,
-                              TraceInfoValues* info, Value* sm, Value* warpp) {
+                              TraceInfoValues* info) {
     
       // apply volatile filters if exists
       if (args.sm.size() > 0 || args.warpp.size() > 0) {
+        Value* sm = getSm(irb);
+        Value* warpp = getWarpp(irb);
         Value* to_be_traced_volatile_ptr = irb.CreateAlloca(i8_ty);
                        
         Value* filter_volatile_call_args[] = {
@@ -461,6 +480,91 @@ namespace cuprof {
       return std::vector<Function*>(kernels.begin(), kernels.end());
     }
 
+    // keep an uninstrumented copy of the kernel, which the host launches
+    // instead of the kernel when the launch is not traced
+    Function* cloneNativeKernel(Function* kernel) {
+      Module& module = *kernel->getParent();
+      
+      ValueToValueMapTy vmap;
+      Function* native = CloneFunction(kernel, vmap);
+      native->setName(getSymbolName(kernel->getName().str(), CUPROF_SYMBOL_NATIVE));
+
+      // annotate the copy as the kernel is (kernel, maxntid, ...)
+      NamedMDNode* kernel_md = module.getNamedMetadata("nvvm.annotations");
+      if (!kernel_md)
+        return native;
+      
+      SmallVector<MDNode*, 4> native_mds;
+      for (const MDNode* node : kernel_md->operands()) {
+        if (node->getNumOperands() == 0)
+          continue;
+        ValueAsMetadata* val = dyn_cast_or_null<ValueAsMetadata>(node->getOperand(0).get());
+        if (!val || val->getValue() != kernel)
+          continue;
+        
+        SmallVector<Metadata*, 8> ops(node->op_begin(), node->op_end());
+        ops[0] = ValueAsMetadata::get(native);
+        native_mds.push_back(MDNode::get(module.getContext(), ops));
+      }
+      for (MDNode* node : native_mds) {
+        kernel_md->addOperand(node);
+      }
+      
+      return native;
+    }
+
+    // replace the kernel by a copy taking the launch data (LAUNCH_DATA_*)
+    // as an extra last parameter, which the host pass passes to each launch.
+    // Data of each launch, unlike globals of the kernel, is not shared with
+    // concurrent launches of the kernel. Returns the copy, which takes over
+    // the body, name and annotations of the kernel.
+    Function* appendLaunchParam(Function* kernel) {
+      Module& module = *kernel->getParent();
+      FunctionType* kernel_ty = kernel->getFunctionType();
+
+      SmallVector<Type*, 16> params(kernel_ty->param_begin(),
+                                    kernel_ty->param_end());
+      params.push_back(i64p_ty);
+      Function* launched = Function::Create(
+        FunctionType::get(kernel_ty->getReturnType(), params, kernel_ty->isVarArg()),
+        kernel->getLinkage(), "", &module);
+      launched->copyAttributesFrom(kernel);
+      launched->copyMetadata(kernel, 0);
+      launched->takeName(kernel);
+
+      launched->getBasicBlockList().splice(launched->begin(),
+                                           kernel->getBasicBlockList());
+      Function::arg_iterator launched_arg = launched->arg_begin();
+      for (Argument& arg : kernel->args()) {
+        launched_arg->takeName(&arg);
+        arg.replaceAllUsesWith(&*launched_arg++);
+      }
+      launched_arg->setName("launch_data");
+
+      // annotate the copy instead of the kernel (kernel, maxntid, ...)
+      NamedMDNode* kernel_md = module.getNamedMetadata("nvvm.annotations");
+      if (kernel_md) {
+        for (unsigned int i = 0; i < kernel_md->getNumOperands(); i++) {
+          MDNode* node = kernel_md->getOperand(i);
+          if (node->getNumOperands() == 0)
+            continue;
+          ValueAsMetadata* val = dyn_cast_or_null<ValueAsMetadata>(node->getOperand(0).get());
+          if (!val || val->getValue() != kernel)
+            continue;
+        
+          SmallVector<Metadata*, 8> ops(node->op_begin(), node->op_end());
+          ops[0] = ValueAsMetadata::get(launched);
+          kernel_md->setOperand(i, MDNode::get(module.getContext(), ops));
+        }
+      }
+
+      kernel->clearMetadata();
+      kernel->replaceAllUsesWith(ConstantExpr::getBitCast(launched, kernel->getType()));
+      kernel->eraseFromParent();
+      
+      return launched;
+    }
+
     enum PointerKind {
       PK_OTHER = 0,
       PK_GLOBAL,
@@ -535,7 +639,10 @@ namespace cuprof {
             if (callee_name.startswith("llvm.nvvm.atomic")) {
               // ATOMIC Inc/Dec //
               kind = getPointerKind(call->getArgOperand(0), true);
-            } else if ( callee_name == "___cuprof_trace") {
+            } else if ( callee_name == "___cuprof_trace" ||
+                        callee_name == "___cuprof_trace_sector" ||
+                        callee_name == "___cuprof_trace_thread" ||
+                        callee_name == "___cuprof_aggregate") {
               report_fatal_error("already instrumented!");
             } else if ( !callee_name.startswith("llvm.") ) {
               std::string error = "call to non-intrinsic: ";
@@ -587,7 +694,6 @@ namespace cuprof {
       Value* cta[3];
       getCta(irb, &cta);
       Value* cta_serial = getCtaSerial(irb, cta);
-      Value* cta_i = getCtaIndex(irb, cta);
       Value* grid = getGrid(irb);
 
     
@@ -608,9 +714,15 @@ namespace cuprof {
                       CUPROF_SYMBOL_KERNEL_ID).c_str()
         );
       Value* kernel_id = irb.CreateLoad(kernel_id_ptr, "kernel_id");
+      
+      // data of the launch (appendLaunchParam()), NULL if not traced
+      Value* launch_data = &*std::prev(kernel->arg_end());
+      Value* launch_skip = irb.CreateZExt(irb.CreateIsNull(launch_data),
+                                          i32_ty, "launch_skip");
       GlobalVariable* trace_info = getOrInsertGlobalVariableExtern(
         module, trace_info_ty, CUPROF_TRACE_BASE_INFO
         );
+      Value* info_ptr = irb.CreatePointerBitCastOrAddrSpaceCast(trace_info, i8p_ty);
 
       
 
@@ -618,42 +730,17 @@ namespace cuprof {
       //////////////////////////////////
 
       
-      Value* slot = irb.CreateAnd(cta_i, irb.getInt32(SLOTS_PER_DEV - 1));
-
-      //Value* base_i = irb.CreateMul(slot, ConstantInt::get(i32_ty, CACHELINE));
-      //Value* slot_i = irb.CreateMul(irb.CreateZExt(slot, i64_ty),
-      //                              ConstantInt::get(i64_ty, RECORDS_PER_SLOT));
-      //slot_i = irb.CreateMul(slot_i, ConstantInt::get(i64_ty, RECORD_SIZE_MAX));
-      
-      Value* base_i = irb.CreateMul(slot, ConstantInt::get(i32_ty, CACHELINE));
-      Value* slot_i = irb.CreateMul(slot, ConstantInt::get(i32_ty, SLOT_SIZE));
-      //slot_i = irb.CreateMul(slot_i, ConstantInt::get(i32_ty, RECORD_SIZE_MAX));
-
-      Value* allocs_ptr = irb.CreateStructGEP(nullptr, trace_info, 0);
-      Value* alloc = irb.CreateLoad(allocs_ptr, "alloc");
-      alloc = irb.CreateInBoundsGEP(i8_ty, alloc, base_i);
-      alloc = irb.CreateBitCast(alloc, i32p_ty);
-
-      Value* commits_ptr = irb.CreateStructGEP(nullptr, trace_info, 1);
-      Value* commit = irb.CreateLoad(commits_ptr, "commit");
-      commit = irb.CreateInBoundsGEP(i8_ty, commit, base_i);
-      commit = irb.CreateBitCast(commit, i32p_ty);
-
-      Value* flusheds_ptr = irb.CreateStructGEP(nullptr, trace_info, 2);
-      Value* flushed = irb.CreateLoad(flusheds_ptr, "flushed");
-      flushed = irb.CreateInBoundsGEP(i8_ty, flushed, base_i);
-      flushed = irb.CreateBitCast(flushed, i32p_ty);
-      
-      Value* signals_ptr = irb.CreateStructGEP(nullptr, trace_info, 3);
-      Value* signal = irb.CreateLoad(signals_ptr, "signal");
-      signal = irb.CreateInBoundsGEP(i8_ty, signal, base_i);
-      signal = irb.CreateBitCast(signal, i32p_ty);
-
-      Value* records_ptr = irb.CreateStructGEP(nullptr, trace_info, 4);
-      Value* records = irb.CreateLoad(records_ptr, "records");
-      records = irb.CreateInBoundsGEP(i8_ty, records, slot_i);
-
-
+      // home slot of the thread: SM-affine by default, so that a slot sees
+      // traffic mainly from a single SM
+      Value* slot_key;
+      if (args.slot_policy == SLOT_POLICY_CTA) {
+        slot_key = getCtaIndex(irb, cta);
+      } else {
+        slot_key = getSm(irb);
+      }
+      Value* slot_count_ptr = irb.CreateStructGEP(nullptr, trace_info, 5);
+      Value* slot_count = irb.CreateLoad(slot_count_ptr, "slot_count");
+      Value* slot = irb.CreateURem(slot_key, slot_count);
 
       // initialize constant filters
     
@@ -678,7 +765,8 @@ namespace cuprof {
       Value* filter_call_args[] = {
         to_be_traced, filter_grid, filter_cta, filter_warpv,
         filter_grid_count, filter_cta_count, filter_warp_count,
-        cta_serial, warpv
+        cta_serial, warpv,
+        info_ptr, kernel_id, launch_skip
       };
       irb.CreateCall(filter_call, filter_call_args);
       to_be_traced = irb.CreateLoad(to_be_traced, "to_be_traced");
@@ -699,18 +787,40 @@ namespace cuprof {
 
 
 
+      // per-launch stats of the kernel, fetched by the host after the launch
+
+      Value* kstat = irb.CreateConstGEP1_32(launch_data, LAUNCH_DATA_KSTAT);
+
+
+      
+      // aggregation table of the launch, indexed by instid (0: unused),
+      // sized by the host from the inst count of the kernel header
+      
+      Value* aggdat = ConstantPointerNull::get(cast<PointerType>(i64p_ty));
+      if (args.aggregate) {
+        aggdat = irb.CreateConstGEP1_32(launch_data, LAUNCH_DATA_AGG);
+      }
+
+
+
+      // bundle the per-thread constants into the trace context,
+      // so that each site passes a single pointer
+
+      Value* ctx = irb.CreateAlloca(trace_ctx_ty, nullptr, "trace_ctx");
+      Value* ctx_fields[] = {
+        info_ptr, aggdat, kstat,
+        grid, cta_serial,
+        slot, warpv, lane, kernel_id
+      };
+      for (unsigned int i = 0; i < sizeof(ctx_fields)/sizeof(*ctx_fields); i++) {
+        irb.CreateStore(ctx_fields[i], irb.CreateStructGEP(trace_ctx_ty, ctx, i));
+      }
+
+      
+
       // set info
     
-      info->alloc = alloc;
-      info->commit = commit;
-      info->flushed = flushed;
-      info->signal = signal;
-      info->records = records;
-      info->grid = grid;
-      info->cta_serial = cta_serial;
-      info->warpv = warpv;
-      info->lane = lane;
-      info->kernel = kernel_id;
+      info->ctx = ctx;
       info->filter_sm = filter_sm;
       info->filter_warpp = filter_warpp;
       info->filter_sm_count = filter_sm_count;
@@ -776,6 +886,49 @@ namespace cuprof {
 
 
   
+    // insert either a record write or, in aggregation mode, an update of
+    // the per-instruction counters.
+    // In sector mode, memory accesses (req_size != 0) write sector records.
+    // Thread execute/return (data == nullptr) write fixed-size records.
+    void insertTraceCall(IRBuilder<>& irb, TraceInfoValues* info,
+                         Value* data, uint32_t instid, uint32_t req_size) {
+      
+      Constant* instid_const = ConstantInt::get(i32_ty, instid);
+
+      // insert volatile filter if exists
+      Value* to_be_traced = info->to_be_traced;
+      insertFilterVolatile(irb, &to_be_traced, info);
+
+      if (args.aggregate) {
+        if (!data)
+          data = ConstantInt::get(i64_ty, -1);
+        
+        Value* aggregate_call_args[] = {
+          info->ctx, data,
+          instid_const, ConstantInt::get(i32_ty, req_size),
+          to_be_traced
+        };
+        irb.CreateCall(aggregate_call, aggregate_call_args);
+        return;
+      }
+
+      if (!data) {
+        Value* trace_thread_call_args[] = {
+          info->ctx, instid_const, to_be_traced
+        };
+        irb.CreateCall(trace_thread_call, trace_thread_call_args);
+        return;
+      }
+      
+      Value* trace_call_args[] = {
+        info->ctx, data, instid_const, to_be_traced
+      };
+      irb.CreateCall((args.sector && req_size != 0) ? trace_sector_call : trace_call,
+                     trace_call_args);
+    }
+
+
+  
     bool instrumentMemAccess(Function* kernel, ArrayRef<Instruction*> memacc_insts,
                              TraceInfoValues* info,
                              std::vector<trace_header_inst_t>& inst_headers) {
@@ -824,39 +977,21 @@ namespace cuprof {
 
         
 
+        PointerType* p_ty = dyn_cast<PointerType>(ptr_operand->getType());
+        uint32_t req_size = dat_layout.getTypeStoreSize(p_ty->getElementType());
+
+        
+
         // insert func call
         
         // insert argument calculation
         irb.SetInsertPoint(inst->getNextNode()); // insert after the access
         Value* addr = irb.CreatePtrToInt(ptr_operand, irb.getInt64Ty());
-        Value* sm = getSm(irb);
-        Value* warpp = getWarpp(irb);
-        Constant* instid_const = ConstantInt::get(i32_ty, instid);
-
-        
-        // insert volatile filter if exists
-        Value* to_be_traced = info->to_be_traced;
-        insertFilterVolatile(irb, &to_be_traced, info, sm, warpp);
-
-        // create call
-        Value* trace_call_args[] = {
-          info->alloc, info->commit,
-          info->flushed, info->signal,
-          info->records, addr,
-          info->grid, info->cta_serial,
-          info->warpv, info->lane,
-          instid_const, info->kernel,
-          sm, warpp,
-          to_be_traced
-        };
-        irb.CreateCall(trace_call, trace_call_args);
+        insertTraceCall(irb, info, addr, instid, req_size);
 
 
         
         // append inst info to the header
-        
-        PointerType* p_ty = dyn_cast<PointerType>(ptr_operand->getType());
-        uint32_t req_size = dat_layout.getTypeStoreSize(p_ty->getElementType());
 
         uint64_t inst_meta[TRACE_HEADER_INST_META_SIZE] = {};
         inst_meta[0] = req_size;
@@ -883,28 +1018,7 @@ namespace cuprof {
 
       // trace call
       irb.restoreIP(ipfront);
-      Value* addr = ConstantInt::get(i64_ty, -1);
-      Value* instid_arg = ConstantInt::get(i32_ty, instid);
-      Value* sm = getSm(irb);
-      Value* warpp = getWarpp(irb);
-      
-      
-      // insert volatile filter if exists
-      Value* to_be_traced = info->to_be_traced;
-      insertFilterVolatile(irb, &to_be_traced, info, sm, warpp);
-    
-    
-      Value* trace_call_args[] = {
-        info->alloc, info->commit,
-        info->flushed, info->signal,
-        info->records, addr,
-        info->grid, info->cta_serial,
-        info->warpv, info->lane,
-        instid_arg, info->kernel,
-        sm, warpp,
-        to_be_traced
-      };
-      irb.CreateCall(trace_call, trace_call_args);
+      insertTraceCall(irb, info, nullptr, instid, 0);
 
       uint64_t inst_meta[TRACE_HEADER_INST_META_SIZE] = {};
         
@@ -924,33 +1038,13 @@ namespace cuprof {
         }
 
         
-        instid_arg = ConstantInt::get(i32_ty, instid);
-        Value* sm = getSm(irb);
-        Value* warpp = getWarpp(irb);
-      
-      
-        // insert volatile filter if exists
-        to_be_traced = info->to_be_traced;
-        insertFilterVolatile(irb, &to_be_traced, info, sm, warpp);
-
-        Value* trace_call_args[] = {
-          info->alloc, info->commit,
-          info->flushed, info->signal,
-          info->records, addr,
-          info->grid, info->cta_serial,
-          info->warpv, info->lane,
-          instid_arg, info->kernel,
-          sm, warpp,
-          to_be_traced
-        };
-        irb.CreateCall(trace_call, trace_call_args);
+        insertTraceCall(irb, info, nullptr, instid, 0);
 
-        
-        Value* trace_ret_call_args[] = {
-          info->commit, info->signal,
-          info->lane
-        };
-        irb.CreateCall(trace_ret_call, trace_ret_call_args);
+        // nothing to flush when aggregating
+        if (!args.aggregate) {
+          Value* trace_ret_call_args[] = {info->ctx};
+          irb.CreateCall(trace_ret_call, trace_ret_call_args);
+        }
 
         
         debuginfo_not_found = debuginfo_not_found
@@ -992,6 +1086,11 @@ namespace cuprof {
         if (kernel_filtering && !isKernelToBeTraced(kernel, args.kernel))
           continue;
 
+        if (args.dual) {
+          cloneNativeKernel(kernel);
+        }
+        kernel = appendLaunchParam(kernel);
+
         
         // kernel instrumentation
       
@@ -1,4 +1,5 @@
 #include <set>
+#include <map>
 #include <iostream>
 #include <cuda_runtime_api.h>
 
@@ -10,6 +11,7 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 
 #include "common.h"
@@ -21,6 +23,10 @@
 
 #define DEBUG_TYPE "cuprof-host"
 
+#ifndef CUDA_LAUNCH_FUNC_NAME
+#define CUDA_LAUNCH_FUNC_NAME "cudaLaunchKernel"
+#endif
+
 
 
 
@@ -60,12 +66,11 @@ namespace cuprof {
     Type* i32_ty = nullptr;
     Type* i64_ty = nullptr;
 
-    FunctionCallee cuprof_init = nullptr;
-    FunctionCallee cuprof_term = nullptr;
     FunctionCallee cuprof_gvsym_set_up = nullptr;
-    FunctionCallee cuprof_kernel_set_up = nullptr;
-    FunctionCallee trc_start = nullptr;
-    FunctionCallee trc_stop = nullptr;
+    FunctionCallee cuprof_module_set_up = nullptr;
+    FunctionCallee cuprof_kernel_fetch = nullptr;
+    FunctionCallee cuprof_kernel_launch = nullptr;
+    FunctionCallee cuprof_launch_data = nullptr;
     FunctionCallee cuda_get_device = nullptr;
     FunctionCallee cuda_memcpy_to_symbol = nullptr;
     FunctionCallee cuda_memcpy_from_symbol = nullptr;
@@ -102,25 +107,21 @@ namespace cuprof {
   
     void findOrInsertRuntimeFunctions(Module& module) {
     
-      cuprof_init =
-        module.getOrInsertFunction("___cuprof_init",
-                                   void_ty);
-      cuprof_term =
-        module.getOrInsertFunction("___cuprof_term",
-                                   void_ty);
       cuprof_gvsym_set_up =
         module.getOrInsertFunction("___cuprof_gvsym_set_up",
                                    void_ty, i8p_ty);
-      cuprof_kernel_set_up =
-        module.getOrInsertFunction("___cuprof_kernel_set_up",
-                                   void_ty, i8p_ty, i8p_ty);
-
-      trc_start =
-        module.getOrInsertFunction("___cuprof_trace_start",
-                                   void_ty, i_ty, i8p_ty, i8p_ty, i64_ty, i16_ty);
-      trc_stop =
-        module.getOrInsertFunction("___cuprof_trace_stop",
-                                   void_ty, i_ty, i8p_ty);
+      cuprof_module_set_up =
+        module.getOrInsertFunction("___cuprof_module_set_up",
+                                   void_ty, i8p_ty->getPointerTo(), i32_ty);
+      cuprof_kernel_fetch =
+        module.getOrInsertFunction("___cuprof_kernel_fetch",
+                                   void_ty, i8p_ty, i8p_ty, i32_ty);
+      cuprof_kernel_launch =
+        module.getOrInsertFunction("___cuprof_kernel_launch",
+                                   i32_ty, i8p_ty, i64_ty, i32_ty,
+                                   i64_ty, i32_ty, size_ty, i8p_ty);
+      cuprof_launch_data =
+        module.getOrInsertFunction("___cuprof_launch_data", i8p_ty);
     
       cuda_get_device =
         module.getOrInsertFunction("cudaGetDevice",
@@ -235,73 +236,53 @@ namespace cuprof {
     }
 
     ///////////////////////////////////////////////////////////////
-    bool registerFuncToGetDebugData(Module& module, const std::string kernel_name) {
+    // append the symbols of the kernel to <syms>, in the layout of
+    // ___cuprof_module_set_up (KERNEL_SYM_UNIT per kernel)
+    void getKernelSymbols(Module& module, const std::string kernel_name,
+                          SmallVectorImpl<Constant*>& syms) {
 
       std::string varname_kdata = getSymbolName(kernel_name, CUPROF_SYMBOL_DATA_VAR);
       std::string varname_kid = getSymbolName(kernel_name, CUPROF_SYMBOL_KERNEL_ID);
-      std::string funcname = getSymbolName(kernel_name, CUPROF_SYMBOL_DATA_FUNC);
 
-      
-      // get symbols for arguments of a function to be called
-      GlobalVariable* gv_kdata =
+      Constant* kernel_syms[KERNEL_SYM_UNIT];
+      kernel_syms[KERNEL_SYM_DATA] =
         getOrInsertGlobalVar(module, i8p_ty, varname_kdata.c_str());
-      //Value* kdata_sym = irb.CreatePointerCast(gv_kdata, i8p_ty);
-      GlobalVariable* gv_kid =
+      kernel_syms[KERNEL_SYM_ID] =
         getOrInsertGlobalVar(module, i8p_ty, varname_kid.c_str());
-      //Value* kid_sym = irb.CreatePointerCast(gv_kid, i8p_ty);
-
-      registerFuncToGlobalCtor(module, cuprof_kernel_set_up, {gv_kdata, gv_kid}, funcname);
-
-      return true;
-      /*
-      // add a function
-      LLVMContext& ctx = module.getContext();
-      FunctionCallee func_callee = module.getOrInsertFunction(funcname.c_str(), void_ty);
-      Function* func = dyn_cast<Function>(func_callee.getCallee());
-      if (!func || !func->empty()) return false;
-      func->setCallingConv(CallingConv::C);
-    
-
-
-      // add entry block for the function
-      BasicBlock* block = BasicBlock::Create(ctx, "entry", func);
-      IRBuilder<> irb(block);
+      kernel_syms[KERNEL_SYM_AGG] = Constant::getNullValue(i8p_ty);
+      if (args.aggregate) {
+        kernel_syms[KERNEL_SYM_AGG] =
+          ConstantExpr::getIntToPtr(ConstantInt::get(i64_ty, 1), i8p_ty);
+      }
 
+      for (Constant* sym : kernel_syms) {
+        syms.push_back(ConstantExpr::getPointerCast(sym, i8p_ty));
+      }
+    }
 
+    // set up all kernels of the module with a single call of the runtime,
+    // with a table of their symbols
+    bool registerKernelsToGlobalCtor(Module& module,
+                                     SmallVector<Function*, 32> kernel_list) {
+      if (kernel_list.empty())
+        return false;
       
-      //Value* varlen_alloca = irb.CreateAlloca(size_ty);
-      //Value* varlen_voidptr = irb.CreatePointerCast(varlen_alloca, i8p_ty);
-      //irb.CreateStore(ConstantInt::get(size_ty, 0), varlen_alloca);
-    
-      //Value* cuda_get_symbol_size_args[] = {varlen_voidptr, var_sym};
-      //irb.CreateCall(cuda_get_symbol_size, cuda_get_symbol_size_args);
-    
-      //Value* varlen_val = irb.CreateLoad(size_ty, varlen_alloca);
-
-
-    
-      //Value* var_alloca = irb.CreateAlloca(i8_ty, varlen_val);
-      //Value* cuda_memcpy_from_symbol_args[] = {
-      //  var_alloca, var_sym,
-      //  varlen_val,
-      //  ConstantInt::get(size_ty, 0),
-      //  ConstantInt::get(cuda_memcpy_kind_ty, cudaMemcpyDeviceToHost)
-      //};
-      //irb.CreateCall(cuda_memcpy_from_symbol, cuda_memcpy_from_symbol_args);
-
-      Value* cuprof_kernel_set_up_args[] = {kdata_sym, kid_sym};
-      irb.CreateCall(cuprof_kernel_set_up, cuprof_kernel_set_up_args);
-    
-      irb.CreateRetVoid();
-
-
+      SmallVector<Constant*, 32 * KERNEL_SYM_UNIT> syms;
+      for (Function* kernel : kernel_list) {
+        getKernelSymbols(module, kernel->getName().str(), syms);
+      }
 
-      // append created function to global ctor
-      appendGlobalCtorDtor(module, func, GLOBAL_CTOR, GLOBAL_CDTOR_DEFAULT_PRIORITY + 1);
-    
+      ArrayType* syms_ty = ArrayType::get(i8p_ty, syms.size());
+      GlobalVariable* gv_syms =
+        new GlobalVariable(module, syms_ty, true, GlobalValue::PrivateLinkage,
+                           ConstantArray::get(syms_ty, syms),
+                           "___cuprof_kernel_syms");
       
-      return true;
-      */
+      std::string funcname = getSymbolName(module.getModuleIdentifier(),
+                                           CUPROF_SYMBOL_DATA_FUNC);
+      return registerFuncToGlobalCtor(
+        module, cuprof_module_set_up,
+        {gv_syms, ConstantInt::get(i32_ty, kernel_list.size())}, funcname);
     }
 
     
@@ -391,6 +372,7 @@ namespace cuprof {
       //SmallVector<Function*, 8> registeredKernels;
       SmallVector<GlobalVariable*, 32> gvs;
 
+      registerKernelsToGlobalCtor(module, kernel_list);
   
       // push metadata for each kernel to the list
       for (SmallVector<Function*, 32>::iterator kernel = kernel_list.begin();
@@ -398,7 +380,6 @@ namespace cuprof {
            ++kernel) {
         StringRef kernel_name_ref = (*kernel)->getName();
         std::string kernel_name = kernel_name_ref.str();
-        registerFuncToGetDebugData(module, kernel_name); /////////////////////////
 
         std::string kdata_name = getSymbolName(kernel_name,
                                                CUPROF_SYMBOL_DATA_VAR);
@@ -432,64 +413,267 @@ namespace cuprof {
  ***********************/
 
 
-    void patchKernelCall(CallInst* configure_call, Instruction* launch,
-                         const StringRef kernel_name) {
-      assert(configure_call->getNumArgOperands() == 6);
+    // uninstrumented copy of a kernel stub, launching the uninstrumented
+    // copy of the kernel that the device pass adds in dual mode.
+    // Returns nullptr if the stub is not registered in this module.
+    Function* createNativeStub(Function* stub, Function* cuda_setup_func) {
+      Module& module = *stub->getParent();
+      std::string native_name = getSymbolName(stub->getName().str(),
+                                              CUPROF_SYMBOL_NATIVE);
+
+      // find where the stub is registered to its device function
+      Function* register_func = module.getFunction("__cudaRegisterFunction");
+      SmallVector<CallInst*, 2> register_calls;
+      if (register_func && cuda_setup_func) {
+        for (User* user : register_func->users()) {
+          CallInst* call = dyn_cast<CallInst>(user);
+          if (call && call->getFunction() == cuda_setup_func &&
+              call->getArgOperand(1)->stripPointerCasts() == stub) {
+            register_calls.push_back(call);
+          }
+        }
+      }
+      if (register_calls.empty())
+        return nullptr;
+
+
+      // the stub passes itself to the launch, so map it to the copy
+      Function* native = Function::Create(stub->getFunctionType(),
+                                          stub->getLinkage(),
+                                          native_name, &module);
+      ValueToValueMapTy vmap;
+      vmap[stub] = native;
+      Function::arg_iterator native_arg = native->arg_begin();
+      for (Argument& arg : stub->args()) {
+        native_arg->setName(arg.getName());
+        vmap[&arg] = &*native_arg++;
+      }
+      SmallVector<ReturnInst*, 8> returns;
+      CloneFunctionInto(native, stub, vmap, stub->getSubprogram() != nullptr,
+                        returns);
+
+
+      // register the copy to the device function of the same name
+      for (CallInst* call : register_calls) {
+        IRBuilder<> irb(call->getNextNode());
+        Value* native_name_val = irb.CreateGlobalStringPtr(native_name);
+        
+        CallInst* native_call = cast<CallInst>(call->clone());
+        native_call->setArgOperand(
+          1, irb.CreateBitCast(native, call->getArgOperand(1)->getType()));
+        native_call->setArgOperand(2, native_name_val); // deviceFun
+        native_call->setArgOperand(3, native_name_val); // deviceName
+        irb.Insert(native_call);
+      }
       
-      IRBuilder<> irb(configure_call->getNextNode());
+      return native;
+    }
 
-      
-      Value* device_num_alloc = irb.CreateAlloca(i_ty);
-      Value* cuda_get_device_args[] = {device_num_alloc};
-      irb.CreateCall(cuda_get_device, cuda_get_device_args);
-      Value* device_num = irb.CreateLoad(i_ty, device_num_alloc);
 
-      Value* stream = configure_call->getArgOperand(5);
-      Value* stream_ptr = irb.CreateBitCast(stream, i8p_ty);
-      Value* kernel_name_val = irb.CreateGlobalStringPtr(kernel_name);
+    // stub launched by a launch API call, also if routed by patchKernelCall()
+    Function* getLaunchedStub(CallBase* launch_call) {
+      Value* func = launch_call->getArgOperand(0)->stripPointerCasts();
+      if (SelectInst* select = dyn_cast<SelectInst>(func)) {
+        func = select->getTrueValue()->stripPointerCasts();
+      }
+      return dyn_cast<Function>(func);
+    }
+
+    // pass the launch data of the runtime to the launches of the
+    // stubs, as the extra last parameter that the device pass appends to
+    // instrumented kernels: the argument array of each launch API call of
+    // a stub (also where the stub is inlined) gets one more entry.
+    // Must run after the native stubs are cloned, which launch kernels
+    // without the parameter, and after the launches are recorded, so that
+    // the data is taken after ___cuprof_kernel_launch() has set it up.
+    void patchLaunchArgs(Module& module, const std::set<Function*>& stubs) {
+      Function* launch_func = module.getFunction(CUDA_LAUNCH_FUNC_NAME);
+      if (!launch_func)
+        return;
+
+      SmallVector<CallBase*, 32> launch_calls;
+      for (User* user : launch_func->users()) {
+        CallBase* call = dyn_cast<CallBase>(user);
+        if (!call || call->getCalledFunction() != launch_func ||
+            call->getNumArgOperands() == 0)
+          continue;
+        if (Function* stub = getLaunchedStub(call)) {
+          if (stubs.count(stub) > 0)
+            launch_calls.push_back(call);
+        }
+      }
 
+      for (CallBase* call : launch_calls) {
+        IRBuilder<> irb_entry(&*call->getFunction()->getEntryBlock().getFirstInsertionPt());
+        Value* launch_data = irb_entry.CreateAlloca(i8p_ty, nullptr, "launch_data");
+        IRBuilder<> irb(call);
+        irb.CreateStore(irb.CreateCall(cuprof_launch_data), launch_data);
+        Value* arg = irb.CreateBitCast(launch_data, i8p_ty);
+        
+#if (LLVM_VERSION_MAJOR < 9)
+        // cudaLaunch(func): the arguments are set up one by one with
+        // cudaSetupArgument(arg, size, offset) before, in the stub
+        FunctionCallee setup_func = module.getFunction(CUDA_POPCONF_FUNC_NAME);
+        uint64_t offset = 0;
+        for (User* user : cast<Function>(setup_func.getCallee())->users()) {
+          CallInst* setup = dyn_cast<CallInst>(user);
+          if (!setup || setup->getFunction() != call->getFunction())
+            continue;
+          ConstantInt* size = dyn_cast<ConstantInt>(setup->getArgOperand(1));
+          ConstantInt* begin = dyn_cast<ConstantInt>(setup->getArgOperand(2));
+          if (size && begin)
+            offset = std::max(offset, begin->getZExtValue() + size->getZExtValue());
+        }
+        offset = alignTo(offset, sizeof(void*));
+        
+        Value* setup_args[] = {
+          arg, ConstantInt::get(size_ty, sizeof(void*)),
+          ConstantInt::get(size_ty, offset)
+        };
+        irb.CreateCall(setup_func, setup_args);
+#else
+        // cudaLaunchKernel(func, grid, cta, args, shared, stream),
+        // args holding a pointer to each argument of the stub
+        uint32_t arg_count = getLaunchedStub(call)->arg_size();
+        Type* launch_args_ty = ArrayType::get(i8p_ty, arg_count + 1);
+        Value* launch_args = irb_entry.CreateAlloca(launch_args_ty, nullptr, "launch_args");
+        Value* stub_args = irb.CreateBitCast(call->getArgOperand(3),
+                                             i8p_ty->getPointerTo());
+        for (uint32_t i = 0; i < arg_count; i++) {
+          irb.CreateStore(irb.CreateLoad(irb.CreateConstGEP1_32(stub_args, i)),
+                          irb.CreateConstGEP2_32(launch_args_ty, launch_args, 0, i));
+        }
+        irb.CreateStore(arg, irb.CreateConstGEP2_32(launch_args_ty, launch_args,
+                                                    0, arg_count));
+        call->setArgOperand(
+          3, irb.CreateBitCast(launch_args, call->getArgOperand(3)->getType()));
+#endif
+      }
+    }
 
-      // Thread block size of the current kernel call
+
+    // record the launch (dims, stream, enqueue time) right before it,
+    // with the launch configuration pushed by the configure call.
+    // The runtime tells whether the launch is traced; if not, the launch
+    // goes to native_stub instead, if any.
+    // Returns the value of whether the launch is traced.
+    Value* patchKernelCall(CallInst* configure_call, Instruction* launch,
+                           Function* kernel, Function* native_stub) {
+      const StringRef kernel_name = kernel->getName();
+      assert(configure_call->getNumArgOperands() == 6);
+      Module& module = *launch->getModule();
+      
+      IRBuilder<> irb(launch);
       
-      Instruction::CastOps castop_i32_i64 = CastInst::getCastOpcode(
-        Constant::getNullValue(i32_ty), false, i64_ty, false);
-      Instruction::CastOps castop_i64_i16 = CastInst::getCastOpcode(
-        Constant::getNullValue(i64_ty), false, i16_ty, false);
-      Instruction::CastOps castop_i32_i16 = CastInst::getCastOpcode(
-        Constant::getNullValue(i32_ty), false, i16_ty, false);
+      std::string varname_kid = getSymbolName(kernel_name.str(),
+                                              CUPROF_SYMBOL_KERNEL_ID);
+      GlobalVariable* gv_kid =
+        getOrInsertGlobalVar(module, i8p_ty, varname_kid.c_str());
+      Value* kid_sym = irb.CreatePointerCast(gv_kid, i8p_ty);
 
       Value* grid_dim = configure_call->getArgOperand(0);   // <32-bit: y> <32-bit: x>
       Value* grid_dim_z = configure_call->getArgOperand(1); // <32-bit: z>
-      grid_dim_z = irb.CreateShl(
-        irb.CreateCast(castop_i32_i64, grid_dim_z, i64_ty),
-        48
-        ); // z: shift 48 left
-      grid_dim = irb.CreateOr(
-        irb.CreateAnd(grid_dim, 0xFFFFFFFFFFFF),
-        grid_dim_z
-        ); // <16-bit: z> <16-bit: y> <32-bit: x>
+      Value* cta_dim = configure_call->getArgOperand(2);    // <32-bit: y> <32-bit: x>
+      Value* cta_dim_z = configure_call->getArgOperand(3);  // <32-bit: z>
+      Value* shared_mem = irb.CreateZExtOrTrunc(configure_call->getArgOperand(4),
+                                                size_ty);
+      Value* stream = configure_call->getArgOperand(5);
+      Value* stream_ptr = irb.CreateBitCast(stream, i8p_ty);
 
+      Value* kernel_launch_args[] = {kid_sym, grid_dim, grid_dim_z,
+                                     cta_dim, cta_dim_z, shared_mem, stream_ptr};
+      Value* traced = irb.CreateICmpNE(
+        irb.CreateCall(cuprof_kernel_launch, kernel_launch_args),
+        ConstantInt::get(i32_ty, 0));
+
+      if (!native_stub)
+        return traced;
+
+      // route the launch: either a call of the stub,
+      // or a launch API call with the stub as the function
+      CallBase* launch_call = cast<CallBase>(launch);
+      if (launch_call->getCalledFunction() == kernel) {
+        launch_call->setCalledOperand(
+          irb.CreateSelect(traced, kernel, native_stub));
+        
+      } else if (launch_call->getNumArgOperands() > 0 &&
+                 launch_call->getArgOperand(0)->stripPointerCasts() == kernel) {
+        Value* func = launch_call->getArgOperand(0);
+        launch_call->setArgOperand(
+          0, irb.CreateSelect(traced, func,
+                              irb.CreateBitCast(native_stub, func->getType())));
+      }
       
-      Value* cta_size = configure_call->getArgOperand(2);   // <32-bit: y> <32-bit: x>
-      Value* cta_size_z = configure_call->getArgOperand(3); // <32-bit: z>
-      cta_size = irb.CreateMul(
-        irb.CreateAnd(cta_size, 0xFFFFFFFF),
-        irb.CreateLShr(cta_size, 32)
-        ); // x * y
-      cta_size = irb.CreateMul(
-        irb.CreateCast(castop_i64_i16, cta_size, i16_ty),
-        irb.CreateCast(castop_i32_i16, cta_size_z, i16_ty)
-        ); // <uint16_t>(x*y) * <uint16_t>z
+      return traced;
+    }
 
-    
 
-      Value* trace_start_args[] = {device_num, stream_ptr, kernel_name_val, grid_dim, cta_size};
-      irb.CreateCall(trc_start, trace_start_args);
 
-      irb.SetInsertPoint(launch->getNextNode());
-    
-      Value* trace_stop_args[] = {device_num, stream_ptr};
-      irb.CreateCall(trc_stop, trace_stop_args);
+    // fetch (and reset) the per-launch tables of the kernel
+    // (stats, and aggregation in aggregate mode) after its launch,
+    // if the launch is traced
+    void patchKernelCallFetch(CallInst* configure_call, Instruction* launch,
+                              const StringRef kernel_name, Value* traced) {
+      Module& module = *launch->getModule();
+      
+      Instruction* insert_pt;
+      if (InvokeInst* invokeinst = dyn_cast<InvokeInst>(launch)) {
+        insert_pt = &*invokeinst->getNormalDest()->getFirstInsertionPt();
+      } else {
+        insert_pt = launch->getNextNode();
+      }
+      IRBuilder<> irb(insert_pt);
+      
+      std::string varname_kid = getSymbolName(kernel_name.str(),
+                                              CUPROF_SYMBOL_KERNEL_ID);
+      GlobalVariable* gv_kid =
+        getOrInsertGlobalVar(module, i8p_ty, varname_kid.c_str());
+      Value* kid_sym = irb.CreatePointerCast(gv_kid, i8p_ty);
+      
+      Value* stream = configure_call->getArgOperand(5);
+      Value* stream_ptr = irb.CreateBitCast(stream, i8p_ty);
+
+      Value* kernel_fetch_args[] = {
+        kid_sym, stream_ptr, irb.CreateZExt(traced, i32_ty)
+      };
+      irb.CreateCall(cuprof_kernel_fetch, kernel_fetch_args);
+    }
+  
+
+
+    // route device memory (de)allocations and transfers through the
+    // runtime, which writes them as host events to the trace
+    void patchMemoryCalls(Module& module) {
+      static const char* const memory_funcs[] = {
+        "cudaMalloc",
+        "cudaMallocManaged",
+        "cudaMallocAsync",
+        "cudaFree",
+        "cudaFreeAsync",
+        "cudaMemcpy",
+        "cudaMemcpyAsync",
+        "cudaMemcpy2D",
+        "cudaMemcpy2DAsync",
+        "cudaMemcpyToSymbol",
+        "cudaMemcpyToSymbolAsync",
+        "cudaMemcpyFromSymbol",
+        "cudaMemcpyFromSymbolAsync",
+        "cudaMemset",
+        "cudaMemsetAsync",
+      };
+
+      for (const char* funcname : memory_funcs) {
+        Function* func = module.getFunction(funcname);
+        if (!func)
+          continue;
+
+        FunctionCallee wrapper =
+          module.getOrInsertFunction(std::string("___cuprof_") + funcname,
+                                     func->getFunctionType());
+        func->replaceAllUsesWith(
+          ConstantExpr::getBitCast(cast<Constant>(wrapper.getCallee()),
+                                   func->getType()));
+      }
     }
   
 
@@ -512,35 +696,60 @@ namespace cuprof {
     
 
       // if kernel args is set, kernel filtering is enabled
-      //bool kernel_filtering = (args.kernel.size() != 0);
+      bool kernel_filtering = (args.kernel.size() != 0);
 
 
 
-      // patch calls
-      /*
-        for (KCall& kcall : getAnalysis<LocateKCallsPass>().getLaunchList()) {
-      
-        // kernel filtering
-        if (kernel_filtering && !isKernelToBeTraced(kcall.kernel_obj, args.kernel))
-        continue;
+      // track device memory allocations and transfers
+      patchMemoryCalls(module);
 
-      
-        // patch kernel call
-        patchKernelCall(kcall.configure_call,
-        kcall.kernel_launch,
-        kcall.kernel_obj->getName());
+
+
+      // in dual mode, keep an uninstrumented copy of each kernel stub
+      Function* cuda_setup_func = module.getFunction("__cuda_register_globals");
+      std::map<Function*, Function*> native_stubs;
+      if (args.dual) {
+        for (Function* kernel : getAnalysis<LocateKCallsPass>().getKernelList()) {
+          if (kernel_filtering && !isKernelToBeTraced(kernel, args.kernel))
+            continue;
+          
+          native_stubs[kernel] = createNativeStub(kernel, cuda_setup_func);
         }
-      */
+      }
+
+
+
+      // record kernel calls, and fetch per-launch tables after them
+      for (KCall& kcall : getAnalysis<LocateKCallsPass>().getLaunchList()) {
+        if (!kcall.kernel_launch || !kcall.kernel_obj)
+          continue;
+          
+        if (kernel_filtering && !isKernelToBeTraced(kcall.kernel_obj, args.kernel))
+          continue;
+
+        auto native_stub = native_stubs.find(kcall.kernel_obj);
+        Value* traced = patchKernelCall(
+          kcall.configure_call,
+          kcall.kernel_launch,
+          kcall.kernel_obj,
+          native_stub != native_stubs.end() ? native_stub->second : nullptr);
+        patchKernelCallFetch(kcall.configure_call,
+                             kcall.kernel_launch,
+                             kcall.kernel_obj->getName(),
+                             traced);
+      }
+
+
+      // pass the launch data to each launch of an instrumented kernel
+      std::set<Function*> stubs;
+      for (Function* kernel : getAnalysis<LocateKCallsPass>().getKernelList()) {
+        if (!kernel_filtering || isKernelToBeTraced(kernel, args.kernel))
+          stubs.insert(kernel);
+      }
+      patchLaunchArgs(module, stubs);
+
 
-    
       // register global variables of trace info for all kernels registered in this module
-      appendGlobalCtorDtor(module,
-                           dyn_cast<Function>(cuprof_init.getCallee()),
-                           GLOBAL_CTOR);
-      appendGlobalCtorDtor(module,
-                           dyn_cast<Function>(cuprof_term.getCallee()),
-                           GLOBAL_DTOR);
-      
       //GlobalVariable *gv = getOrInsertGlobalVar(module, trace_info_ty,
       //                                          CUPROF_TRACE_BASE_INFO);
       //registerFuncToGlobalCtor(module, cuprof_gvsym_set_up, {gv}, "___cuprof_base_name");
@@ -551,7 +760,6 @@ namespace cuprof {
       SmallVector<Function*, 32> kernel_list =
         getAnalysis<LocateKCallsPass>().getKernelList();
     
-      Function* cuda_setup_func = module.getFunction("__cuda_register_globals");
       if (cuda_setup_func != nullptr) {
         createAndRegisterTraceVars(cuda_setup_func, kernel_list);
       }
@@ -19,12 +19,37 @@ static llvm::StructType* getTraceInfoType(llvm::LLVMContext &ctx) {
     Type::getInt8PtrTy(ctx),
     Type::getInt8PtrTy(ctx),
     Type::getInt8PtrTy(ctx),
+    Type::getInt8PtrTy(ctx),
+    Type::getInt32Ty(ctx),
+    Type::getInt32Ty(ctx),
+    Type::getInt32PtrTy(ctx),
+    Type::getInt64PtrTy(ctx),
+    Type::getInt32PtrTy(ctx),
     Type::getInt8PtrTy(ctx)
   };
 
   return StructType::create(fields, "traceinfo_t");
 }
 
+static llvm::StructType* getTraceCtxType(llvm::LLVMContext &ctx) {
+  using llvm::Type;
+  using llvm::StructType;
+
+  Type *fields[] = {
+    Type::getInt8PtrTy(ctx),  // traceinfo_t*
+    Type::getInt64PtrTy(ctx),
+    Type::getInt64PtrTy(ctx),
+    Type::getInt64Ty(ctx),
+    Type::getInt64Ty(ctx),
+    Type::getInt32Ty(ctx),
+    Type::getInt32Ty(ctx),
+    Type::getInt32Ty(ctx),
+    Type::getInt32Ty(ctx)
+  };
+
+  return StructType::create(fields, "trace_ctx_t");
+}
+
 
 
 enum CuprofSymbolType {
@@ -32,6 +57,7 @@ enum CuprofSymbolType {
   CUPROF_SYMBOL_DATA_FUNC,
   CUPROF_SYMBOL_KERNEL_ID,
   CUPROF_SYMBOL_BASE_NAME,
+  CUPROF_SYMBOL_NATIVE,
   CUPROF_SYMBOL_END,
 };
 
@@ -45,7 +71,8 @@ const char * const SYMBOL_TYPE_STR[] = {
   "___cuprof_accdat_var_",
   "___cuprof_accdat_func_",
   "___cuprof_kernel_id_",
-  "___cuprof_base_name_"
+  "___cuprof_base_name_",
+  "___cuprof_native_"
 };
 
 
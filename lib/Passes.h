@@ -5,6 +5,12 @@
 
 namespace cuprof {
   
+  // key to map a thread to a slot of the trace buffers
+  enum SlotPolicy {
+    SLOT_POLICY_SM = 0,
+    SLOT_POLICY_CTA,
+  };
+  
   typedef struct InstrumentPassArg {
     bool trace_thread, trace_mem, verbose;
     std::vector<std::string> kernel;
@@ -13,10 +19,14 @@ namespace cuprof {
     std::vector<uint32_t> warpv;
     std::vector<uint32_t> sm;
     std::vector<uint32_t> warpp;
+    SlotPolicy slot_policy;
+    bool aggregate;
+    bool sector;
+    bool dual;
   } InstrumentPassArg;
 
   static InstrumentPassArg args_default = {
-    true, true, false, {}, {}, {}, {}, {}
+    true, true, false, {}, {}, {}, {}, {}, {}, SLOT_POLICY_SM, false, false, false
   };
 
   
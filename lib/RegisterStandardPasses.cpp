@@ -79,6 +79,18 @@ namespace cuprof {
           pass_args.trace_mem = true;
 
           
+        } else if (optname == "aggregate") {
+          pass_args.aggregate = true;
+
+          
+        } else if (optname == "sector") {
+          pass_args.sector = true;
+
+          
+        } else if (optname == "dual") {
+          pass_args.dual = true;
+
+          
         } else if (optname == "kernel") {
           std::string optarg;
           while (getline(optarglist, optarg, ARG_VAL_DELIM)) {
@@ -153,6 +165,19 @@ namespace cuprof {
           }
           
           
+        } else if (optname == "slot") {
+          std::string optarg;
+          getline(optarglist, optarg);
+          
+          if (optarg == "sm") {
+            pass_args.slot_policy = SLOT_POLICY_SM;
+          } else if (optarg == "cta") {
+            pass_args.slot_policy = SLOT_POLICY_CTA;
+          } else {
+            fprintf(stderr, "cuprof: unknown slot policy: %s\n", optarg.c_str());
+          }
+          
+          
         } else {
           fprintf(stderr, "cuprof: unused argument: %s\n", optstr.c_str());
         }
@@ -10,7 +10,7 @@ extern "C" {
   
 
 
-#define RECORD_HEADER_UNIT (6)
+#define RECORD_HEADER_UNIT (7)
 #define RECORD_HEADER_UNIT_SIZE (sizeof(uint64_t))
 #define RECORD_HEADER_SIZE \
   ((RECORD_HEADER_UNIT_SIZE) * (RECORD_HEADER_UNIT))
@@ -28,12 +28,43 @@ extern "C" {
 #define MULTI_BUF_COUNT (4)
 #define SLOT_SIZE (UNIT_SLOT_SIZE * MULTI_BUF_COUNT)
 //((size_t) 4096*(RECORD_SIZE_MAX) + (RECORD_SIZE_MAX))
-// Number of slots must be power of two!
-#define SLOTS_PER_DEV (16)
+// Slots per device are sized to the SM count at runtime, up to the max
+// and to the record memory budget (CUPROF_SLOT_MEMORY)
+#define SLOTS_PER_DEV_MAX (256)
 
 #define CACHELINE (128)
 
+// address ranges of global memory accesses to be traced:
+// {count, {base, size} * count}, count 0 traces all
+#define ADDR_RANGE_MAX (8)
+#define ADDR_RANGE_TABLE_UNIT (1 + 2 * ADDR_RANGE_MAX)
+
+// runtime control of tracing by the host API, read by each thread
+// at kernel entry: {enabled, kernel count, kernel id * count},
+// kernel count 0 traces all kernels
+  enum CONTROL_FIELD {
+    CONTROL_ENABLED = 0,
+    CONTROL_KERNEL_COUNT = 1,
+    CONTROL_KERNELS = 2,
+  };
+#define KERNEL_FILTER_MAX (16)
+#define CONTROL_TABLE_UNIT (CONTROL_KERNELS + KERNEL_FILTER_MAX)
+
+// memory transaction granularity of the device
+#define SECTOR_SIZE (32)
+#define SECTOR_SIZE_BITS (5)
+
 //#define CUPROF_RECBUF_MANAGED
+//#define CUPROF_MAPPED_ACK_DISABLE
+
+// what a warp does when its slot is full
+// (selected at runtime by CUPROF_BACKPRESSURE)
+  enum BACKPRESSURE_POLICY {
+    BACKPRESSURE_SPIN = 0,    // spin on the flushed counter
+    BACKPRESSURE_SLEEP = 1,   // exponential backoff with __nanosleep (sm_70+)
+    BACKPRESSURE_YIELD = 2,   // back off without memory traffic
+    BACKPRESSURE_HANDOFF = 3, // allocate in another slot with room
+  };
 
 //#define CUPROF_ODE_DISABLE
 //#define CUPROF_CRW_DISABLE
@@ -49,6 +80,12 @@ extern "C" {
     uint8_t* flusheds_d;
     uint8_t* signals_d;
     uint8_t* records_d;
+    uint32_t slot_count;
+    uint32_t backpressure; // BACKPRESSURE_*
+    uint32_t* sampling_d;  // memory records are kept 1 in *sampling_d
+    uint64_t* addr_ranges_d; // ADDR_RANGE_TABLE_UNIT
+    uint32_t* control_d;     // CONTROL_TABLE_UNIT
+    uint8_t* flusheds_seen_d; // device copy of flusheds_d, read before it
   } traceinfo_t;
   
   typedef struct {
@@ -57,8 +94,23 @@ extern "C" {
     uint8_t* flusheds_old;
     uint8_t* signals_h;
     uint8_t* records_h;
+    int flusheds_mapped; // flusheds_h is mapped host memory of flusheds_d
   } traceinfo_host_t;
   
+  // per-thread constants of the trace, set up at kernel entry
+  // (mirrored by getTraceCtxType() of the passes)
+  typedef struct {
+    traceinfo_t* info;
+    uint64_t* aggdat;
+    uint64_t* kstat;
+    uint64_t grid;
+    uint64_t cta_serial;
+    uint32_t slot; // home slot of the thread
+    uint32_t warpv;
+    uint32_t laneid;
+    uint32_t kernid;
+  } trace_ctx_t;
+  
   typedef unsigned char byte;
 
 
@@ -74,11 +126,9 @@ extern "C" {
 // decoding records
   
 #define RECORD_GET_NONZEROMASK(record)                  \
-  (LLGT_GET_BITFIELD(((uint64_t*)record)[0], 26, 38))
-#define RECORD_GET_KERNID(record)                       \
-  (LLGT_GET_BITFIELD(((uint64_t*)record)[0], 16, 10))
-#define RECORD_GET_INSTID(record)                       \
-  (LLGT_GET_BITFIELD(((uint64_t*)record)[0], 5, 11))
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[0], 25, 39))
+#define RECORD_GET_KIND(record)                         \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[0], 5, 4))
 #define RECORD_GET_WARP_V(record)                       \
   (LLGT_GET_BITFIELD(((uint64_t*)record)[0], 0, 5))
   
@@ -97,15 +147,20 @@ extern "C" {
 #define RECORD_GET_GRID(record)                 \
   (((uint64_t*)record)[3])
 
+#define RECORD_GET_MSB(record)                          \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[4], 32, 32))
 #define RECORD_GET_WARP_P(record)                       \
-    (LLGT_GET_BITFIELD(((uint64_t*)record)[4], 32, 32))
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[4], 16, 16))
 #define RECORD_GET_SM(record)                           \
-  (LLGT_GET_BITFIELD(((uint64_t*)record)[4], 0, 32))
-  
-#define RECORD_GET_MSB(record)                          \
-  (LLGT_GET_BITFIELD(((uint64_t*)record)[5], 32, 32))
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[4], 0, 16))
+
 #define RECORD_GET_CLOCK(record)                        \
-  (LLGT_GET_BITFIELD(((uint64_t*)record)[5], 0, 32))
+  (((uint64_t*)record)[5])
+
+#define RECORD_GET_KERNID(record)                       \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[6], 32, 32))
+#define RECORD_GET_INSTID(record)                       \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[6], 0, 32))
 
 
 #define RECORD_GET_DELTA(record, i)                                     \
@@ -120,11 +175,10 @@ extern "C" {
   
 // encoding records
 
-#define RECORD_SET_HEADER_0(nonzero_mask, kernid, instid, warpv)        \
-  ((LLGT_SET_BITFIELD(nonzero_mask, 26, 38)) |                          \
-   (LLGT_SET_BITFIELD(kernid, 16, 10)) |                                \
-   (LLGT_SET_BITFIELD(instid, 5, 11)) |                                 \
-   (LLGT_SET_BITFIELD(instid, 0, 5)))
+#define RECORD_SET_HEADER_0(nonzero_mask, kind, warpv)  \
+  ((LLGT_SET_BITFIELD(nonzero_mask, 25, 39)) |          \
+   (LLGT_SET_BITFIELD(kind, 5, 4)) |                    \
+   (LLGT_SET_BITFIELD(warpv, 0, 5)))
 #define RECORD_SET_HEADER_1(activemask, writemask)      \
   (LLGT_SET_BITFIELD(activemask, 32, 32) |              \
    (LLGT_SET_BITFIELD(writemask, 0, 32)))
@@ -132,19 +186,232 @@ extern "C" {
   ((uint64_t)(cta))
 #define RECORD_SET_HEADER_3(grid)               \
   ((uint64_t)(grid))
-#define RECORD_SET_HEADER_4(warpp, sm)          \
-  (LLGT_SET_BITFIELD(warpp, 32, 32) |           \
-   (LLGT_SET_BITFIELD(sm, 0, 32)))
-#define RECORD_SET_HEADER_5(msb, clock)         \
+#define RECORD_SET_HEADER_4(msb, warpp, sm)     \
   (LLGT_SET_BITFIELD(msb, 32, 32) |             \
-   (LLGT_SET_BITFIELD(clock, 0, 32)))
+   LLGT_SET_BITFIELD(warpp, 16, 16) |           \
+   (LLGT_SET_BITFIELD(sm, 0, 16)))
+#define RECORD_SET_HEADER_5(clock)              \
+  ((uint64_t)(clock))
+#define RECORD_SET_HEADER_6(kernid, instid)     \
+  (LLGT_SET_BITFIELD(kernid, 32, 32) |          \
+   (LLGT_SET_BITFIELD(instid, 0, 32)))
 
 #define RECORD_SET_DATA(delta, data)            \
   (LLGT_SET_BITFIELD(delta, 32, 32) |           \
    (LLGT_SET_BITFIELD(data, 0, 32)))
 
+
+// record kinds
+//
+// RECORD_KIND_ADDR: a data word per written lane (delta | addr lsb)
+// RECORD_KIND_SECTOR: a data word per unique 32B sector of the request,
+//   written by the lowest lane touching it (writemask);
+//   sector address | (lanes touching it - 1)
+// RECORD_KIND_THREAD: fixed-size record of thread execute/return,
+//   without header word 1 and data words (see below)
+
+  enum RECORD_KIND {
+    RECORD_KIND_ADDR = 0,
+    RECORD_KIND_SECTOR = 1,
+    RECORD_KIND_THREAD = 2,
+  };
+
+#define RECORD_GET_SECTOR_ADDR(word)                    \
+  (((uint64_t)(word)) & ~(uint64_t)(SECTOR_SIZE - 1))
+#define RECORD_GET_SECTOR_LANES(word)                   \
+  (LLGT_GET_BITFIELD(word, 0, SECTOR_SIZE_BITS) + 1)
+#define RECORD_SET_SECTOR(addr, lanes)                  \
+  ((((uint64_t)(addr)) & ~(uint64_t)(SECTOR_SIZE - 1)) |        \
+   LLGT_SET_BITFIELD((lanes) - 1, 0, SECTOR_SIZE_BITS))
+
   
 
+// thread records
+//
+// Word 0 is the same as the other records (nonzero mask, kind, warpv).
+// The other words are those of the record header except word 1, and the
+// activemask takes the place of msb.
+
+#define RECORD_THREAD_UNIT (6)
+#define RECORD_THREAD_SIZE \
+  ((RECORD_HEADER_UNIT_SIZE) * (RECORD_THREAD_UNIT))
+
+#define RECORD_THREAD_GET_CTAX(record)                  \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[1], 32, 32))
+#define RECORD_THREAD_GET_CTAY(record)                  \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[1], 16, 16))
+#define RECORD_THREAD_GET_CTAZ(record)                  \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[1], 0, 16))
+#define RECORD_THREAD_GET_GRID(record)          \
+  (((uint64_t*)record)[2])
+#define RECORD_THREAD_GET_ACTIVEMASK(record)            \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[3], 32, 32))
+#define RECORD_THREAD_GET_WARP_P(record)                \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[3], 16, 16))
+#define RECORD_THREAD_GET_SM(record)                    \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[3], 0, 16))
+#define RECORD_THREAD_GET_CLOCK(record)         \
+  (((uint64_t*)record)[4])
+#define RECORD_THREAD_GET_KERNID(record)                \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[5], 32, 32))
+#define RECORD_THREAD_GET_INSTID(record)                \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[5], 0, 32))
+  
+
+
+// host records
+//
+// Records written by the host runtime are interleaved with the device
+// records in a trace. Header word 0 of a device record is never zero, so
+// bit 0 of its nonzero mask is always set. A host record leaves the whole
+// nonzero mask cleared and keeps its type in the low bits instead, followed
+// by the payload length (in bytes) and the payload padded to 8 bytes.
+
+#define HOSTREC_HEADER_UNIT (2)
+#define HOSTREC_HEADER_SIZE \
+  ((RECORD_HEADER_UNIT_SIZE) * (HOSTREC_HEADER_UNIT))
+#define HOSTREC_PAYLOAD_SIZE(len) \
+  ((((uint64_t)(len)) + 7) & ~(uint64_t)7)
+#define HOSTREC_SIZE(len) \
+  (HOSTREC_HEADER_SIZE + HOSTREC_PAYLOAD_SIZE(len))
+
+#define RECORD_IS_HOSTREC(record)               \
+  (RECORD_GET_NONZEROMASK(record) == 0)
+#define HOSTREC_GET_TYPE(record)                        \
+  (LLGT_GET_BITFIELD(((uint64_t*)record)[0], 0, 16))
+#define HOSTREC_GET_LEN(record)                 \
+  (((uint64_t*)record)[1])
+
+#define HOSTREC_SET_HEADER_0(type)              \
+  (LLGT_SET_BITFIELD(type, 0, 16))
+#define HOSTREC_SET_HEADER_1(len)               \
+  ((uint64_t)(len))
+
+  enum HOSTREC_TYPE {
+    HOSTREC_NONE = 0,
+    HOSTREC_CLOCK_CALIB = 1,  // {gpu globaltimer (ns), host CLOCK_MONOTONIC (ns)}
+    HOSTREC_AGGREGATE = 2,    // {kernel id, inst count, agg entries (0: total)}
+    HOSTREC_KERNEL_STAT = 3,  // {kernel id, KSTAT_UNIT, kstat fields}
+    HOSTREC_SAMPLING = 4,     // {host CLOCK_MONOTONIC (ns), sampling divisor}
+    HOSTREC_ALLOC = 5,        // {host CLOCK_MONOTONIC (ns), base, size, kind, call site}
+    HOSTREC_MEMOP = 6,        // {host begin (ns), host end (ns), kind, direction,
+                              //  dst, src (memset: value), size, stream}
+    HOSTREC_LAUNCH = 7,       // {host enqueue (ns), kernel id, launch seq,
+                              //  grid xy, grid z, block xy, block z,
+                              //  shared mem, stream}
+    HOSTREC_MARKER = 8,       // {host CLOCK_MONOTONIC (ns), kind, name}
+    HOSTREC_LAUNCH_SAMPLING = 9,  // {host CLOCK_MONOTONIC (ns), kernel id,
+                                  //  launches, skipped launches,
+                                  //  first, every, from, to}
+    HOSTREC_KERNEL = 10,      // {kernel id, kernel header data}, before the
+                              //  first launch record of the kernel
+  };
+
+
+// the device stores %globaltimer next to the flush signal of a slot,
+// which the host pairs with its own clock when the signal is observed
+#define SIGNAL_TIME_OFFSET (8)
+
+
+// aggregation entries
+//
+// In aggregation mode, each traced launch has a table of AGG_ENTRY_UNIT
+// counters (uint64_t) per instruction id in its launch data, instead of
+// writing records. The host fetches the table after the launch.
+
+  enum AGG_FIELD {
+    AGG_REQUESTS = 0,   // warp-level requests
+    AGG_ACCESSES = 1,   // thread-level accesses (active lanes)
+    AGG_SECTORS = 2,    // unique 32B sectors touched by the requests
+    AGG_BYTES = 3,      // bytes requested
+    AGG_LANE_HIST = 4,  // requests per active lane count (1-32)
+    AGG_ENTRY_UNIT = AGG_LANE_HIST + 32,
+  };
+
+// per-launch kernel stats, in the launch data
+  enum KSTAT_FIELD {
+    KSTAT_STALL_NS = 0,     // time warps waited for a slot to be flushed
+    KSTAT_STALL_COUNT = 1,  // allocations that waited
+    KSTAT_UNIT = 2,
+  };
+
+// launch data: device memory of its own for each traced launch, passed by
+// the host to the instrumented kernel as its last argument (NULL if the
+// launch is not traced), and fetched after the launch. Offsets in uint64_t.
+  enum LAUNCH_DATA_FIELD {
+    LAUNCH_DATA_KSTAT = 0,  // KSTAT_UNIT stats
+    LAUNCH_DATA_AGG = LAUNCH_DATA_KSTAT + KSTAT_UNIT, // aggregation table
+    LAUNCH_DATA_UNIT = LAUNCH_DATA_AGG, // without the aggregation table
+  };
+
+// device memory (de)allocations by the host, in HOSTREC_ALLOC
+  enum ALLOC_KIND {
+    ALLOC_KIND_MALLOC = 0,
+    ALLOC_KIND_MANAGED = 1,
+    ALLOC_KIND_MALLOC_ASYNC = 2,
+    ALLOC_KIND_FREE = 3,
+    ALLOC_KIND_FREE_ASYNC = 4,
+  };
+#define ALLOC_KIND_IS_FREE(kind) \
+  ((kind) == ALLOC_KIND_FREE || (kind) == ALLOC_KIND_FREE_ASYNC)
+#define HOSTREC_ALLOC_UNIT (5)
+
+// memory transfers / sets by the host, in HOSTREC_MEMOP
+  enum MEMOP_KIND {
+    MEMOP_KIND_MEMCPY = 0,
+    MEMOP_KIND_MEMCPY_2D = 1,    // size: width * height
+    MEMOP_KIND_MEMCPY_SYMBOL = 2,
+    MEMOP_KIND_MEMSET = 3,
+  };
+// same values as cudaMemcpyKind, and none for memsets
+  enum MEMOP_DIR {
+    MEMOP_DIR_HTOH = 0,
+    MEMOP_DIR_HTOD = 1,
+    MEMOP_DIR_DTOH = 2,
+    MEMOP_DIR_DTOD = 3,
+    MEMOP_DIR_DEFAULT = 4,
+    MEMOP_DIR_NONE = 5,
+  };
+#define HOSTREC_MEMOP_UNIT (8)
+
+// kernel launches by the host, in HOSTREC_LAUNCH
+// (xy: <32-bit: y> <32-bit: x>, as dim3 is passed to the launch)
+#define HOSTREC_LAUNCH_UNIT (9)
+
+// markers of the host API, in HOSTREC_MARKER
+  enum MARKER_KIND {
+    MARKER_KIND_USER = 0,   // cuprofMarker()
+    MARKER_KIND_START = 1,  // cuprofStart()
+    MARKER_KIND_STOP = 2,   // cuprofStop()
+  };
+// name: NUL-padded, not terminated if HOSTREC_MARKER_NAME_MAX long
+#define HOSTREC_MARKER_NAME_MAX (48)
+#define HOSTREC_MARKER_UNIT (2 + HOSTREC_MARKER_NAME_MAX / sizeof(uint64_t))
+
+// launch sampling of the host, in HOSTREC_LAUNCH_SAMPLING
+// (launches of a kernel counted from 1; the policy fields are 0 if unset)
+// Within launches [from, to], the first <first> launches and then every
+// <every>th launch are traced; all launches of the range if both are 0.
+#define HOSTREC_LAUNCH_SAMPLING_UNIT (8)
+
+// max payload of host records queued by the runtime
+#define HOSTREC_EVENT_UNIT_MAX (9)
+
+// payload of host records of kernel tables (HOSTREC_AGGREGATE,
+// HOSTREC_KERNEL_STAT): kernel id and entry count, followed by the table
+#define HOSTREC_TABLE_PREFIX_SIZE (2 * sizeof(uint64_t))
+
+
+// symbols of each kernel of a module, as passed by the host pass to
+// ___cuprof_module_set_up
+  enum KERNEL_SYM_FIELD {
+    KERNEL_SYM_DATA = 0,         // header data of the kernel
+    KERNEL_SYM_ID = 1,           // kernel id, set by the host
+    KERNEL_SYM_AGG = 2,          // not a symbol: NULL if not aggregated
+    KERNEL_SYM_UNIT = 3,
+  };
+
+
   enum RECORD_TYPE {
     RECORD_LOAD = 0,
     RECORD_STORE = 1,
@@ -9,6 +9,11 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "common.h"
 
 
@@ -32,6 +37,11 @@ extern "C" {
   
   static const char TRACE_HEADER_PREFIX[] = "__CUPROF_TRACE__";
   static const char TRACE_HEADER_POSTFIX[] = "__CUPROF_TRACE__END__";
+
+// v2: 7-word record header with 32-bit kernel / instruction ids
+// v3: kernel header data in HOSTREC_KERNEL records (v2: only in the header)
+#define TRACE_FORMAT_VERSION (3)
+#define TRACE_FORMAT_VERSION_MIN (2)
   static const char* trace_last_error = NULL;
 
 
@@ -57,10 +67,67 @@ extern "C" {
 #define TRACE_HEADER_INST_META_SIZE 5
   
   
+  // receives the written data of a tracefile on each flush, in file order;
+  // returns 0 on error
+  typedef int (*tracefile_sink_t)(void* arg, const void* data, size_t size);
+  
+  // size of the data area of shared memory rings, power of 2
+#ifndef TRACEFILE_SHM_SIZE
+#define TRACEFILE_SHM_SIZE (64 * 1024 * 1024)
+#endif
+#define TRACEFILE_SHM_MAGIC 0x4d48535446525543ULL // "CURFTSHM" in little-endian byte order
+  // define TRACEFILE_SHM_KEEP to keep the ring after the writer closes it,
+  // for readers attaching later; otherwise the writer removes it on close
+
+  /* Shared memory ring (header of the segment, data area follows)
+   *
+   * A single writer appends the trace stream to the data area, at
+   * stream offset % capacity, and never waits for readers, which map
+   * the segment read-only and can attach at any time (before the ring
+   * first wraps, to read the trace from its header). Offsets only grow.
+   *
+   * writer, for each chunk [head, head + n):
+   *   1. reserve = head + n        (relaxed store)
+   *   2. release fence
+   *   3. copy the chunk
+   *   4. head = head + n           (release store)
+   *   closed = 1 (release store) at the end of the trace
+   *
+   * reader at offset pos, for n bytes:
+   *   1. wait until head >= pos + n (acquire load), or end of trace
+   *      if closed and head < pos + n
+   *   2. copy the bytes out
+   *   3. acquire fence
+   *   4. if reserve > pos + capacity (relaxed load), the writer may
+   *      have overwritten them during the copy: the reader fell behind
+   *      by more than the ring and fails
+   *
+   * Fields are cacheline separated, so that readers polling head do
+   * not slow down the writer.
+   */
+  typedef struct {
+    uint64_t magic;      // TRACEFILE_SHM_MAGIC once initialized
+    uint64_t capacity;   // size of the data area
+    uint64_t closed;
+    uint64_t pad0[5];
+    uint64_t reserve;
+    uint64_t pad1[7];
+    uint64_t head;
+    uint64_t pad2[7];
+  } tracefile_shm_header_t;
+  
   typedef struct {
-    int file;
+    int file;                 // -1: written to the sink / ring only
+    int is_socket;
     uint64_t buf_commits;
+    uint64_t file_size;       // bytes flushed to the file
     unsigned char* buf;
+    tracefile_sink_t sink;    // NULL if none
+    void* sink_arg;
+    tracefile_shm_header_t* shm; // NULL if not a shared memory ring
+    char* shm_name;           // name of the ring to remove on close (writer)
+    uint64_t shm_pos;         // offset of the reader in the ring
+    int shm_overrun;          // the reader fell behind the writer
   } tracefile_base_t;
 
   typedef tracefile_base_t* tracefile_t;
@@ -113,6 +180,8 @@ extern "C" {
   
     const trace_header_kernel_t* kernel_info;
     const trace_header_inst_t* inst_info;
+    uint32_t kernid;
+    uint32_t kind; // RECORD_KIND_*
     uint32_t warpv;
     
     uint32_t activemask;
@@ -126,23 +195,107 @@ extern "C" {
     uint32_t sm;
     
     uint32_t msb;
-    uint32_t clock;
+    uint64_t clock;
 
     uint64_t thread_data[RECORD_DATA_UNIT_MAX];
+
+    // RECORD_KIND_SECTOR: unique sectors of the request, in lane order
+    // (RECORD_GET_SECTOR_ADDR / RECORD_GET_SECTOR_LANES to decode)
+    uint32_t sector_count;
+    uint64_t sectors[RECORD_DATA_UNIT_MAX];
   } trace_record_t;
 
   typedef struct {
-    tracefile_t tracefile;
-    uint64_t kernel_count;
-    uint64_t kernel_i;
-    trace_header_kernel_t** kernel_accdat;
+    uint32_t type; // HOSTREC_NONE if the current item is a device record
+    uint64_t len;
+    byte* payload;
+    uint64_t payload_cap;
+  } trace_hostrec_t;
+
+  typedef struct {
+    uint64_t gpu_time;
+    uint64_t host_time;
+  } trace_clock_calib_t;
 
+  typedef struct {
+    uint32_t kernid;
+    uint64_t insts_count;
+    const uint64_t* entries; // AGG_ENTRY_UNIT per entry; 0: total, i: inst id i
+  } trace_aggregate_t;
+
+  typedef struct {
+    uint32_t kernid;
+    uint64_t stall_ns;    // time warps waited for a full slot
+    uint64_t stall_count; // allocations that waited
+  } trace_kernel_stat_t;
+
+  typedef struct {
+    uint64_t id;        // sequence number of the allocation in the trace
+    uint64_t base;
+    uint64_t size;      // 0 if a freed pointer was not allocated in the trace
+    uint32_t kind;      // ALLOC_KIND_*
+    uint64_t call_site; // return address of the host call
+    uint64_t host_time; // host CLOCK_MONOTONIC (ns) of the call
+  } trace_alloc_t;
+
+  typedef struct {
+    uint64_t host_time;  // host CLOCK_MONOTONIC (ns) of the enqueue
+    uint32_t kernid;     // 0 if the kernel was not set up
+    uint64_t seq;        // launch sequence number of the process
     cta_t grid_dim;
-    uint16_t cta_size;
-    char new_kernel;
+    cta_t cta_dim;
+    uint64_t shared_mem;
+    uint64_t stream;     // 0: default stream
+  } trace_launch_t;
+
+  typedef struct {
+    uint64_t host_time;  // host CLOCK_MONOTONIC (ns) of the call
+    uint32_t kind;       // MARKER_KIND_*
+    char name[HOSTREC_MARKER_NAME_MAX + 1];
+  } trace_marker_t;
+
+  typedef struct {
+    uint64_t host_time;  // host CLOCK_MONOTONIC (ns) of the record
+    uint32_t kernid;
+    uint64_t launches;   // launches of the kernel so far, traced or not
+    uint64_t skipped;    // launches not sampled so far
+    uint64_t first;      // policy, see HOSTREC_LAUNCH_SAMPLING
+    uint64_t every;
+    uint64_t from;
+    uint64_t to;
+  } trace_launch_sampling_t;
+
+  typedef struct {
+    tracefile_t tracefile;
+    uint64_t kernel_count;    // highest kernel id so far
+    uint64_t kernel_cap;      // entries of kernel_accdat and launches
+    trace_header_kernel_t** kernel_accdat; // empty_kernel if not known (yet)
+
+    trace_launch_t* launches; // latest launch of each kernel, by kernel id
     trace_record_t record;
+    trace_hostrec_t hostrec;
+    trace_clock_calib_t clock_calib; // latest pair read from the trace
+    uint32_t sampling_div; // memory records are sampled 1 in sampling_div
+
+    // live allocations at the current position, sorted by base
+    trace_alloc_t* allocs;
+    uint64_t alloc_count;
+    uint64_t alloc_cap;
+    uint64_t alloc_seq;
+    trace_alloc_t alloc_event; // the latest HOSTREC_ALLOC
   } trace_t;
 
+  typedef struct {
+    uint64_t host_begin; // host CLOCK_MONOTONIC (ns) of the call
+    uint64_t host_end;   // return of the call (enqueue only if async)
+    uint32_t kind;       // MEMOP_KIND_*
+    uint32_t direction;  // MEMOP_DIR_*
+    uint64_t dst;
+    uint64_t src;        // value for memsets
+    uint64_t size;
+    uint64_t stream;     // 0: default stream
+  } trace_memop_t;
+
   
 #define CONST_MAX(x, y) ((x) > (y) ? (x) : (y))
 #include <errno.h> ///////////////////////////////////////////
@@ -153,6 +306,163 @@ extern "C" {
  ******************/
   
   typedef enum {TRACEFILE_READ, TRACEFILE_WRITE} tracefile_mode_t;
+
+  // filenames of this prefix name a Unix domain socket to stream to
+#define TRACEFILE_UNIX_PREFIX "unix:"
+  
+  // the reader listens on the socket and accepts a single writer,
+  // the writer connects to it; returns the connection or -1
+  static inline int tracefile_unix_socket(const char* path, tracefile_mode_t mode) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+      return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+      return -1;
+
+    if (mode == TRACEFILE_WRITE) {
+      if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+      }
+      return sock;
+    }
+
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        listen(sock, 1) == -1) {
+      close(sock);
+      return -1;
+    }
+    int conn;
+    do {
+      conn = accept(sock, NULL, NULL);
+    } while (conn == -1 && errno == EINTR);
+    close(sock);
+    unlink(path);
+    return conn;
+  }
+  
+  // filenames of this prefix name a shared memory ring to publish to
+#define TRACEFILE_SHM_PREFIX "shm:"
+
+  static inline int tracefile_shm_wait() {
+    struct timespec wait = {0, 100000}; // 100us
+    return nanosleep(&wait, NULL);
+  }
+  
+  // the writer (re)creates the ring, readers wait for it to be created
+  // and map it read-only; returns the mapped ring or NULL
+  static inline tracefile_shm_header_t* tracefile_shm_map(const char* name,
+                                                           tracefile_mode_t mode) {
+    const size_t header_size = sizeof(tracefile_shm_header_t);
+    
+    if (mode == TRACEFILE_WRITE) {
+      const size_t map_size = header_size + TRACEFILE_SHM_SIZE;
+      shm_unlink(name); // readers of a previous trace keep their mapping
+      int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      if (fd == -1)
+        return NULL;
+      if (ftruncate(fd, map_size) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+      }
+      void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+      }
+
+      tracefile_shm_header_t* shm = (tracefile_shm_header_t*) map;
+      shm->capacity = TRACEFILE_SHM_SIZE;
+      shm->closed = 0;
+      shm->reserve = 0;
+      shm->head = 0;
+      __atomic_store_n(&shm->magic, TRACEFILE_SHM_MAGIC, __ATOMIC_RELEASE);
+      return shm;
+    }
+
+    
+    int fd;
+    while ((fd = shm_open(name, O_RDONLY, 0)) == -1) {
+      if (errno != ENOENT)
+        return NULL;
+      tracefile_shm_wait();
+    }
+
+    // wait until the writer has initialized the header
+    tracefile_shm_header_t* shm = NULL;
+    while (shm == NULL) {
+      struct stat st;
+      if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+      }
+      if ((size_t) st.st_size >= header_size) {
+        void* map = mmap(NULL, header_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+          close(fd);
+          return NULL;
+        }
+        if (__atomic_load_n(&((tracefile_shm_header_t*) map)->magic,
+                            __ATOMIC_ACQUIRE) == TRACEFILE_SHM_MAGIC) {
+          shm = (tracefile_shm_header_t*) map;
+          break;
+        }
+        munmap(map, header_size);
+      }
+      tracefile_shm_wait();
+    }
+
+    const size_t map_size = header_size + shm->capacity;
+    munmap(shm, header_size);
+    void* map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return (map == MAP_FAILED) ? NULL : (tracefile_shm_header_t*) map;
+  }
+
+  // unmap the ring, and remove it if it was created by the writer
+  static inline void tracefile_shm_unmap(tracefile_t tracefile) {
+    munmap(tracefile->shm,
+           sizeof(tracefile_shm_header_t) + tracefile->shm->capacity);
+    tracefile->shm = NULL;
+    if (tracefile->shm_name != NULL) {
+#ifndef TRACEFILE_SHM_KEEP
+      shm_unlink(tracefile->shm_name);
+#endif
+      free(tracefile->shm_name);
+      tracefile->shm_name = NULL;
+    }
+  }
+
+  // copy between the data area of the ring and a buffer, wrapping around
+  static inline void tracefile_shm_copy(tracefile_shm_header_t* shm,
+                                        uint64_t pos, void* data,
+                                        size_t size, int to_ring) {
+    unsigned char* ring = (unsigned char*) (shm + 1);
+    unsigned char* buf = (unsigned char*) data;
+    while (size > 0) {
+      uint64_t offset = pos & (shm->capacity - 1);
+      size_t part = shm->capacity - offset;
+      if (part > size)
+        part = size;
+      if (to_ring)
+        memcpy(ring + offset, buf, part);
+      else
+        memcpy(buf, ring + offset, part);
+      pos += part;
+      buf += part;
+      size -= part;
+    }
+  }
   
   static inline tracefile_t tracefile_open(const char* filename, tracefile_mode_t mode) {
     tracefile_t return_val = (tracefile_t) malloc(sizeof(tracefile_base_t));
@@ -161,9 +471,40 @@ extern "C" {
 
 
     
+    return_val->is_socket = 0;
+    return_val->shm = NULL;
+    return_val->shm_name = NULL;
+    return_val->shm_pos = 0;
+    return_val->shm_overrun = 0;
     if (filename == NULL) {
       return_val->file = STDIN_FILENO;
     }
+    else if (strncmp(filename, TRACEFILE_SHM_PREFIX,
+                     sizeof(TRACEFILE_SHM_PREFIX) - 1) == 0) {
+      const char* name = filename + sizeof(TRACEFILE_SHM_PREFIX) - 1;
+      return_val->shm = tracefile_shm_map(name, mode);
+      if (return_val->shm == NULL) {
+        free(return_val);
+        return NULL;
+      }
+      if (mode == TRACEFILE_WRITE) {
+        return_val->shm_name = strdup(name);
+        if (return_val->shm_name == NULL) {
+          munmap(return_val->shm,
+                 sizeof(tracefile_shm_header_t) + return_val->shm->capacity);
+          shm_unlink(name);
+          free(return_val);
+          return NULL;
+        }
+      }
+      return_val->file = -1;
+    }
+    else if (strncmp(filename, TRACEFILE_UNIX_PREFIX,
+                     sizeof(TRACEFILE_UNIX_PREFIX) - 1) == 0) {
+      return_val->file = tracefile_unix_socket(
+        filename + sizeof(TRACEFILE_UNIX_PREFIX) - 1, mode);
+      return_val->is_socket = 1;
+    }
     else {
       return_val->file = open(filename,
                               (mode == TRACEFILE_WRITE)
@@ -171,7 +512,7 @@ extern "C" {
                               : (O_RDONLY),
                               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     }
-    if (return_val->file == -1) {
+    if (return_val->file == -1 && return_val->shm == NULL) {
       free(return_val);
       return NULL;
     }
@@ -179,10 +520,17 @@ extern "C" {
     
 
     return_val->buf_commits = 0;
+    return_val->file_size = 0;
+    return_val->buf = NULL;
+    return_val->sink = NULL;
+    return_val->sink_arg = NULL;
     if (mode == TRACEFILE_WRITE) {
       return_val->buf = (byte*) malloc(TRACEFILE_BUF_SIZE); //aligned_alloc(512, TRACEFILE_BUF_SIZE);
       if (return_val->buf == NULL) {
-        close(return_val->file);
+        if (return_val->shm != NULL)
+          tracefile_shm_unmap(return_val);
+        else
+          close(return_val->file);
         free(return_val);
         return NULL;
       }
@@ -203,6 +551,105 @@ static inline double rttclock()
 }
 
   
+  // open a tracefile for writing, which passes the written data to the
+  // sink on each flush, and to the file of filename unless it is NULL
+  static inline tracefile_t tracefile_open_sink(const char* filename,
+                                                tracefile_sink_t sink,
+                                                void* sink_arg) {
+    tracefile_t return_val;
+    if (filename != NULL) {
+      return_val = tracefile_open(filename, TRACEFILE_WRITE);
+      if (return_val == NULL)
+        return NULL;
+      
+    } else {
+      return_val = (tracefile_t) malloc(sizeof(tracefile_base_t));
+      if (return_val == NULL)
+        return NULL;
+      return_val->file = -1;
+      return_val->is_socket = 0;
+      return_val->shm = NULL;
+      return_val->shm_name = NULL;
+      return_val->shm_pos = 0;
+      return_val->shm_overrun = 0;
+      return_val->buf_commits = 0;
+      return_val->file_size = 0;
+      return_val->buf = (byte*) malloc(TRACEFILE_BUF_SIZE);
+      if (return_val->buf == NULL) {
+        free(return_val);
+        return NULL;
+      }
+    }
+
+    return_val->sink = sink;
+    return_val->sink_arg = sink_arg;
+    return return_val;
+  }
+  
+  // write all of src, blocking while a pipe or socket is full;
+  // a closed socket fails instead of raising SIGPIPE
+  static inline int tracefile_write_all(tracefile_t tracefile,
+                                        const void* src, size_t size) {
+    const char* pos = (const char*) src;
+    while (size > 0) {
+      ssize_t write_size = tracefile->is_socket
+        ? send(tracefile->file, pos, size, MSG_NOSIGNAL)
+        : write(tracefile->file, pos, size);
+      if (write_size == -1) {
+        if (errno == EINTR)
+          continue;
+        return 0;
+      }
+      pos += write_size;
+      size -= write_size;
+    }
+    return 1;
+  }
+  
+  // write out the buffered data to the file (and the sink)
+  static inline int tracefile_flush(tracefile_t tracefile) {
+    
+    if (tracefile->buf_commits == 0)
+      return 1;
+
+    int return_val = 1;
+    if (tracefile->shm != NULL) {
+      tracefile_shm_header_t* shm = tracefile->shm;
+      uint64_t head = shm->head;
+      uint64_t size = tracefile->buf_commits;
+      __atomic_store_n(&shm->reserve, head + size, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      tracefile_shm_copy(shm, head, tracefile->buf, size, 1);
+      __atomic_store_n(&shm->head, head + size, __ATOMIC_RELEASE);
+    }
+    else if (tracefile->file != -1) {
+      return_val = tracefile_write_all(tracefile, tracefile->buf,
+                                       tracefile->buf_commits);
+      tracefile->file_size += tracefile->buf_commits;
+    }
+    if (tracefile->sink != NULL &&
+        !tracefile->sink(tracefile->sink_arg,
+                         tracefile->buf, tracefile->buf_commits)) {
+      return_val = 0;
+    }
+    tracefile->buf_commits = 0;
+    return return_val;
+  }
+  
+  // flush, then continue writing to a new file, e.g. to rotate files;
+  // on error, the data is only passed to the sink from then on
+  static inline int tracefile_reopen(tracefile_t tracefile, const char* filename) {
+    int return_val = tracefile_flush(tracefile);
+    if (tracefile->file != -1 && close(tracefile->file) == -1)
+      return_val = 0;
+
+    tracefile->file = open(filename,
+                           O_WRONLY | O_CREAT | O_APPEND | O_TRUNC,
+                           S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    tracefile->file_size = 0;
+    return return_val && tracefile->file != -1;
+  }
+  
   static inline int tracefile_close(tracefile_t tracefile) {
     
     if (tracefile == NULL)
@@ -210,13 +657,17 @@ static inline double rttclock()
 
 
     // if unwritten data remains in the buffer, flush to file
-    if (tracefile->buf_commits > 0) {
-      write(tracefile->file,
-            tracefile->buf,
-            tracefile->buf_commits);
+    tracefile_flush(tracefile);
+
+    if (tracefile->shm != NULL) {
+      if (tracefile->buf != NULL) { // writer
+        __atomic_store_n(&tracefile->shm->closed, 1, __ATOMIC_RELEASE);
+      }
+      // attached readers keep their mapping until they are done
+      tracefile_shm_unmap(tracefile);
     }
     
-    int close_result = close(tracefile->file);
+    int close_result = (tracefile->file != -1) ? close(tracefile->file) : 0;
     if (close_result == -1)
       return 0;
 
@@ -230,9 +681,43 @@ static inline double rttclock()
     return 1;
   }
 
+  // read exactly size bytes, waiting on pipes and sockets
+  // until the writer sends them; fails at the end of the trace
   static inline int tracefile_read(tracefile_t tracefile,
                                    void* dest, size_t size) {
-    return (read(tracefile->file, dest, size) == (ssize_t) size);
+
+    if (tracefile->shm != NULL) {
+      tracefile_shm_header_t* shm = tracefile->shm;
+      uint64_t end = tracefile->shm_pos + size;
+      while (__atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) < end) {
+        if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) < end)
+          return 0;
+        tracefile_shm_wait();
+      }
+      
+      tracefile_shm_copy(shm, tracefile->shm_pos, dest, size, 0);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&shm->reserve, __ATOMIC_RELAXED) >
+          tracefile->shm_pos + shm->capacity) {
+        tracefile->shm_overrun = 1;
+        return 0;
+      }
+      tracefile->shm_pos = end;
+      return 1;
+    }
+    
+    char* pos = (char*) dest;
+    while (size > 0) {
+      ssize_t read_size = read(tracefile->file, pos, size);
+      if (read_size == -1 && errno == EINTR)
+        continue;
+      if (read_size <= 0)
+        return 0;
+      pos += read_size;
+      size -= read_size;
+    }
+    return 1;
   }
   
   static inline int tracefile_write(tracefile_t tracefile,
@@ -242,11 +727,7 @@ static inline double rttclock()
     
     // if overflow is expected after write, then flush to file first
     if (tracefile->buf_commits + size >= TRACEFILE_BUF_SIZE) {
-      ssize_t write_size = write(tracefile->file,
-                                 tracefile->buf,
-                                 tracefile->buf_commits);
-      return_val = (write_size == (ssize_t)tracefile->buf_commits);
-      tracefile->buf_commits = 0;
+      return_val = tracefile_flush(tracefile);
     }
 
     // copy to tracefile buffer
@@ -339,7 +820,7 @@ static inline double rttclock()
       uint64_serialize(buf, &offset, inst_header->type);
 
       for (int meta_i = 0; meta_i < TRACE_HEADER_INST_META_SIZE; meta_i++)
-        uint64_serialize(buf, &offset, inst_header->meta[i]);
+        uint64_serialize(buf, &offset, inst_header->meta[meta_i]);
       
       // inst row in file
       uint64_serialize(buf, &offset, inst_header->row);
@@ -380,7 +861,7 @@ static inline double rttclock()
       return 0;
     }
 
-    printf("\nKERNEL\n");//////////
+    //printf("\nKERNEL\n");//////////
 
     size_t offset = 0;
 
@@ -414,7 +895,7 @@ static inline double rttclock()
       
       // metadata for inst
       for (int meta_i = 0; meta_i < TRACE_HEADER_INST_META_SIZE; meta_i++)
-        inst_header->meta[i] = uint64_deserialize(buf, &offset);
+        inst_header->meta[meta_i] = uint64_deserialize(buf, &offset);
       
       // inst row in file
       inst_header->row = uint64_deserialize(buf, &offset);
@@ -426,18 +907,19 @@ static inline double rttclock()
       inst_header->filename_len = uint64_deserialize(buf, &offset);
       
       char* filename = 
-        (char*) malloc(sizeof(inst_header->filename_len));
+        (char*) malloc(inst_header->filename_len + 1);
       inst_header->filename = filename;
       memcpy(filename,
              buf + offset,
              inst_header->filename_len); // inst filename
+      filename[inst_header->filename_len] = '\0';
       offset += inst_header->filename_len;
       if (i != inst_header->id) {
         trace_last_error = "failed to deserialize kernel header";
         return 0;
       }
 
-      printf("\ninstid: %u\n", i);//////////
+      //printf("\ninstid: %u\n", i);//////////
     }
 
     return offset;
@@ -447,8 +929,61 @@ static inline double rttclock()
 
 
 
+  static inline trace_header_kernel_t* trace_kernel_info(const trace_t* t,
+                                                         uint64_t kernid) {
+    return (kernid != 0 && kernid <= t->kernel_count) ?
+      t->kernel_accdat[kernid] :
+      &empty_kernel;
+  }
+
+  static void thread_deserialize(uint8_t* record_serialized, trace_t* trace) {
+    
+    trace_record_t* record = &trace->record;
+    uint64_t nonzero_mask = RECORD_GET_NONZEROMASK(record_serialized);
+    
+    uint64_t* buf_header = (uint64_t*) (record_serialized);
+    for (int i = 0; i < RECORD_THREAD_UNIT; i++)
+      if ((nonzero_mask & ((uint64_t)1 << i)) == 0)
+        buf_header[i] = 0; // recover header
+
+    uint64_t kernid = RECORD_THREAD_GET_KERNID(record_serialized);
+    record->kernel_info = trace_kernel_info(trace, kernid);
+    record->kernid = (uint32_t) kernid;
+    uint64_t instid = RECORD_THREAD_GET_INSTID(record_serialized);
+    record->inst_info = (instid != 0 && instid <= record->kernel_info->insts_count) ?
+      &record->kernel_info->insts[instid] :
+      &empty_inst;
+    record->kind = RECORD_KIND_THREAD;
+    record->warpv = RECORD_GET_WARP_V(record_serialized);
+    
+    record->activemask = RECORD_THREAD_GET_ACTIVEMASK(record_serialized);
+    record->writemask = 0;
+    
+    record->ctaid.x = RECORD_THREAD_GET_CTAX(record_serialized);
+    record->ctaid.y = RECORD_THREAD_GET_CTAY(record_serialized);
+    record->ctaid.z = RECORD_THREAD_GET_CTAZ(record_serialized);
+    
+    record->grid = RECORD_THREAD_GET_GRID(record_serialized);
+    
+    record->warpp = RECORD_THREAD_GET_WARP_P(record_serialized);
+    record->sm = RECORD_THREAD_GET_SM(record_serialized);
+    
+    record->msb = 0;
+    record->clock = RECORD_THREAD_GET_CLOCK(record_serialized);
+
+    // no per-lane data
+    record->sector_count = 0;
+    memset(record->thread_data, 0, sizeof(record->thread_data));
+  }
+  
   static void trace_deserialize(uint8_t* record_serialized, trace_t* trace,
                                 uint32_t data_count) {
+
+    // fixed-size thread records have their own layout
+    if (RECORD_GET_KIND(record_serialized) == RECORD_KIND_THREAD) {
+      thread_deserialize(record_serialized, trace);
+      return;
+    }
     
     trace_record_t* record = &trace->record;
     uint64_t nonzero_mask = RECORD_GET_NONZEROMASK(record_serialized);
@@ -470,13 +1005,13 @@ static inline double rttclock()
     // deserialize header //
     
     uint64_t kernid = RECORD_GET_KERNID(record_serialized);
-    record->kernel_info = (kernid < trace->kernel_count) ?
-      trace->kernel_accdat[kernid] :
-      &empty_kernel;
+    record->kernel_info = trace_kernel_info(trace, kernid);
+    record->kernid = (uint32_t) kernid;
     uint64_t instid = RECORD_GET_INSTID(record_serialized);
-    record->inst_info = (instid < record->kernel_info->insts_count) ?
+    record->inst_info = (instid != 0 && instid <= record->kernel_info->insts_count) ?
       &record->kernel_info->insts[instid] :
       &empty_inst;
+    record->kind = RECORD_GET_KIND(record_serialized);
     record->warpv = RECORD_GET_WARP_V(record_serialized);
     
     record->activemask = RECORD_GET_ACTIVEMASK(record_serialized);
@@ -500,6 +1035,30 @@ static inline double rttclock()
 
 
     
+    // sector list: a word per writing lane //
+
+    if (record->kind == RECORD_KIND_SECTOR) {
+      const uint64_t* buf_data = (uint64_t*) (record_serialized + RECORD_HEADER_SIZE);
+      uint64_t nonzero_mask_data = 
+        LLGT_GET_BITFIELD(nonzero_mask, RECORD_HEADER_UNIT, RECORD_DATA_UNIT_MAX);
+      
+      record->sector_count = 0;
+      for (int lane = 0; lane < RECORD_DATA_UNIT_MAX; lane++) {
+        uint64_t lanemask = LLGT_SET_BITFIELD(1, lane, 1);
+        if (record->writemask & lanemask) {
+          record->sectors[record->sector_count] =
+            (nonzero_mask_data & lanemask) ? buf_data[record->sector_count] : 0;
+          record->sector_count++;
+        }
+      }
+      
+      memset(record->thread_data, 0, sizeof(record->thread_data));
+      return;
+    }
+    record->sector_count = 0;
+
+
+    
     // recover thread data before non-zero conversion //
     
     uint64_t* buf_data = (uint64_t*) (record_serialized + RECORD_HEADER_SIZE);
@@ -555,6 +1114,81 @@ static inline double rttclock()
 
 
   
+  // grow the kernel tables to hold kernel ids up to <kernid>
+  static int trace_kernel_reserve(trace_t* t, uint64_t kernid) {
+    if (kernid < t->kernel_cap)
+      return 0;
+
+    uint64_t cap_new = t->kernel_cap ? t->kernel_cap : 64;
+    while (cap_new <= kernid) {
+      cap_new *= 2;
+    }
+    
+    trace_header_kernel_t** kernel_accdat_new = (trace_header_kernel_t**)
+      realloc(t->kernel_accdat, sizeof(trace_header_kernel_t*) * cap_new);
+    if (!kernel_accdat_new) {
+      return 1;
+    }
+    t->kernel_accdat = kernel_accdat_new;
+    
+    trace_launch_t* launches_new = (trace_launch_t*)
+      realloc(t->launches, sizeof(trace_launch_t) * cap_new);
+    if (!launches_new) {
+      return 1;
+    }
+    t->launches = launches_new;
+
+    // index 0 is reserved for unknown
+    for (uint64_t i = t->kernel_cap; i < cap_new; i++) {
+      t->kernel_accdat[i] = &empty_kernel;
+    }
+    memset(t->launches + t->kernel_cap, 0,
+           sizeof(trace_launch_t) * (cap_new - t->kernel_cap));
+    t->kernel_cap = cap_new;
+    return 0;
+  }
+
+  // add the header data of a kernel (from the header or a HOSTREC_KERNEL);
+  // returns the size of the data, or 0 on error
+  static size_t trace_kernel_add(trace_t* t, uint64_t kernid, byte* data) {
+    if (kernid == 0 || trace_kernel_reserve(t, kernid) != 0) {
+      trace_last_error = "failed to allocate memory";
+      return 0;
+    }
+    
+    size_t kernel_header_size = sizeof(trace_header_kernel_t) +
+      sizeof(trace_header_inst_t) * uint64_deserialize(data, NULL);
+    trace_header_kernel_t* kernel_cur =
+      (trace_header_kernel_t*) malloc(kernel_header_size);
+    if (!kernel_cur) {
+      trace_last_error = "failed to allocate memory";
+      return 0;
+    }
+    
+    size_t kernel_data_size = header_deserialize(kernel_cur, data);
+    if (kernel_data_size == 0) {
+      free(kernel_cur);
+      trace_last_error = "failed to deserialize kernel header";
+      return 0;
+    }
+
+    // replace the kernel of the id, if any
+    trace_header_kernel_t* kernel_old = t->kernel_accdat[kernid];
+    if (kernel_old != &empty_kernel) {
+      for (uint64_t i_inst = 1; i_inst <= kernel_old->insts_count; i_inst++) {
+        free((char*)kernel_old->insts[i_inst].filename);
+      }
+      free(kernel_old);
+    }
+    t->kernel_accdat[kernid] = kernel_cur;
+    if (kernid > t->kernel_count) {
+      t->kernel_count = kernid;
+    }
+    return kernel_data_size;
+  }
+
+
+  
   static trace_t* trace_open(const char* filename) {
     //int debug_count = 0;
     //printf("%d\n", debug_count++);//////////////////
@@ -574,6 +1208,14 @@ static inline double rttclock()
       return NULL;
     }
 
+    // check trace format version
+    uint64_t version;
+    if (! tracefile_read(input_file, &version, sizeof(version)) ||
+        version < TRACE_FORMAT_VERSION_MIN || version > TRACE_FORMAT_VERSION) {
+      trace_last_error = "unsupported trace format version";
+      return NULL;
+    }
+
     //printf("%d\n", debug_count++);//////////////////
     
     // get trace header length
@@ -602,50 +1244,21 @@ static inline double rttclock()
     //printf("%d\n", debug_count++);//////////////////
     
     // allocate trace_t
-    trace_t* res = (trace_t*) malloc(sizeof(trace_t));
-    res->kernel_accdat = (trace_header_kernel_t**) malloc(sizeof(trace_header_kernel_t*) * (0x3FF + 1)); //////////// 
+    trace_t* res = (trace_t*) calloc(1, sizeof(trace_t));
+    if (!res || trace_kernel_reserve(res, 64) != 0) {
+      trace_last_error = "failed to allocate memory";
+      return NULL;
+    }
 
     
-    //printf("%d\n", debug_count++);//////////////////
-    
-    // build memory access data for each kernels
+    // build memory access data for each kernels of the header (v2),
+    // with ids in the order of the header
     uint64_t kernel_count = 0;
-
-    res->kernel_accdat[0] = &empty_kernel;
     
-    //printf("%d\n", debug_count++);//////////////////
-    
-    for (uint32_t offset = 0; offset < accdat_len; kernel_count++) {
-      
-      //printf("\t%d\n", debug_count++);//////////////////
-
-      
-      size_t kernel_header_size = sizeof(trace_header_kernel_t) +
-        sizeof(trace_header_inst_t) * uint64_deserialize(accdat, NULL);
-      
-      //printf("kernel_header_size: %u\n", kernel_header_size);///////////////
-      //printf("\t%d\n", debug_count++);//////////////////
-      
-      trace_header_kernel_t* kernel_cur =
-        (trace_header_kernel_t*) malloc(kernel_header_size);
-      
-      //printf("\t%d\n", debug_count++);//////////////////
-      
-      if (!kernel_cur) {
-        trace_last_error = "failed to allocate memory";
-        return NULL;
-      }
-      
-      res->kernel_accdat[kernel_count+1] = kernel_cur;
-
-      //printf("\t%d\n", debug_count++);//////////////////
-      
-      size_t kernel_data_size = header_deserialize(kernel_cur, accdat + offset);
-      
-      //printf("\t%d\n", debug_count++);//////////////////
-      
+    for (uint32_t offset = 0; offset < accdat_len; ) {
+      size_t kernel_data_size = trace_kernel_add(res, ++kernel_count,
+                                                 accdat + offset);
       if (kernel_data_size == 0) {
-        trace_last_error = "failed to deserialize kernel header";
         return NULL;
       }
       offset += kernel_data_size;
@@ -663,9 +1276,14 @@ static inline double rttclock()
 
 
     res->tracefile = input_file;
-    res->kernel_count = kernel_count;
-    res->kernel_i = (uint64_t)-1;
-    res->new_kernel = 0;
+    memset(&res->hostrec, 0, sizeof(res->hostrec));
+    memset(&res->clock_calib, 0, sizeof(res->clock_calib));
+    res->sampling_div = 1;
+    res->allocs = NULL;
+    res->alloc_count = 0;
+    res->alloc_cap = 0;
+    res->alloc_seq = 0;
+    memset(&res->alloc_event, 0, sizeof(res->alloc_event));
 
     free(accdat);
     
@@ -673,11 +1291,209 @@ static inline double rttclock()
   }
 
 
+  // index of the first live allocation with base > addr
+  static uint64_t alloc_upper_bound(const trace_t* t, uint64_t addr) {
+    uint64_t lo = 0;
+    uint64_t hi = t->alloc_count;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (t->allocs[mid].base <= addr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  // apply an allocation event to the live allocations
+  static int alloc_apply(trace_t* t, trace_alloc_t* event) {
+
+    // drop live allocations overlapping the event (missed frees)
+    uint64_t end = event->base + (event->size ? event->size : 1);
+    uint64_t first = alloc_upper_bound(t, event->base);
+    if (first > 0 &&
+        t->allocs[first-1].base + t->allocs[first-1].size > event->base) {
+      first--;
+    }
+    uint64_t last = first;
+    while (last < t->alloc_count && t->allocs[last].base < end) {
+      last++;
+    }
+
+    // a free reports the allocation it releases
+    if (ALLOC_KIND_IS_FREE(event->kind)) {
+      event->id = (uint64_t)-1;
+      event->size = 0;
+      if (last - first == 1 && t->allocs[first].base == event->base) {
+        event->id = t->allocs[first].id;
+        event->size = t->allocs[first].size;
+      }
+    }
+    
+    memmove(t->allocs + first, t->allocs + last,
+            (t->alloc_count - last) * sizeof(trace_alloc_t));
+    t->alloc_count -= last - first;
+
+    if (ALLOC_KIND_IS_FREE(event->kind))
+      return 0;
+    if (event->size == 0) {
+      event->id = (uint64_t)-1;
+      return 0;
+    }
+
+    
+    // insert the new allocation
+    event->id = t->alloc_seq++;
+    if (t->alloc_count == t->alloc_cap) {
+      uint64_t cap_new = t->alloc_cap ? t->alloc_cap * 2 : 64;
+      trace_alloc_t* allocs_new = (trace_alloc_t*)
+        realloc(t->allocs, cap_new * sizeof(trace_alloc_t));
+      if (!allocs_new) {
+        trace_last_error = "failed to allocate memory";
+        return 1;
+      }
+      t->allocs = allocs_new;
+      t->alloc_cap = cap_new;
+    }
+    
+    memmove(t->allocs + first + 1, t->allocs + first,
+            (t->alloc_count - first) * sizeof(trace_alloc_t));
+    t->allocs[first] = *event;
+    t->alloc_count++;
+    return 0;
+  }
+
+  static void launch_deserialize(const uint64_t* payload, trace_launch_t* launch) {
+    launch->host_time = payload[0];
+    launch->kernid = (uint32_t) payload[1];
+    launch->seq = payload[2];
+    launch->grid_dim.x = (uint32_t) payload[3];
+    launch->grid_dim.y = (uint16_t) (payload[3] >> 32);
+    launch->grid_dim.z = (uint16_t) payload[4];
+    launch->cta_dim.x = (uint32_t) payload[5];
+    launch->cta_dim.y = (uint16_t) (payload[5] >> 32);
+    launch->cta_dim.z = (uint16_t) payload[6];
+    launch->shared_mem = payload[7];
+    launch->stream = payload[8];
+  }
+
+  static int hostrec_next(trace_t* t, uint8_t* buf) {
+    
+    if (! tracefile_read(t->tracefile, buf + RECORD_HEADER_UNIT_SIZE,
+                         HOSTREC_HEADER_SIZE - RECORD_HEADER_UNIT_SIZE)) {
+      trace_last_error = "unable to read host record";
+      return 1;
+    }
+
+    trace_hostrec_t* hostrec = &t->hostrec;
+    uint64_t len = HOSTREC_GET_LEN(buf);
+    uint64_t payload_size = HOSTREC_PAYLOAD_SIZE(len);
+
+    // grow payload buffer if needed
+    if (payload_size > hostrec->payload_cap) {
+      byte* payload_new = (byte*) realloc(hostrec->payload, payload_size);
+      if (!payload_new) {
+        trace_last_error = "failed to allocate memory";
+        return 1;
+      }
+      hostrec->payload = payload_new;
+      hostrec->payload_cap = payload_size;
+    }
+
+    if (payload_size > 0 &&
+        ! tracefile_read(t->tracefile, hostrec->payload, payload_size)) {
+      trace_last_error = "unable to read host record";
+      return 1;
+    }
+    
+    hostrec->type = HOSTREC_GET_TYPE(buf);
+    hostrec->len = len;
+
+    
+    // keep trace states which later records depend on
+    switch (hostrec->type) {
+      
+    case HOSTREC_CLOCK_CALIB:
+      if (len >= 2 * sizeof(uint64_t)) {
+        t->clock_calib.gpu_time = ((uint64_t*)hostrec->payload)[0];
+        t->clock_calib.host_time = ((uint64_t*)hostrec->payload)[1];
+      }
+      break;
+      
+    case HOSTREC_ALLOC:
+      if (len >= HOSTREC_ALLOC_UNIT * sizeof(uint64_t)) {
+        const uint64_t* payload = (const uint64_t*)hostrec->payload;
+        t->alloc_event.host_time = payload[0];
+        t->alloc_event.base = payload[1];
+        t->alloc_event.size = payload[2];
+        t->alloc_event.kind = (uint32_t) payload[3];
+        t->alloc_event.call_site = payload[4];
+        if (alloc_apply(t, &t->alloc_event) != 0) {
+          return 1;
+        }
+      }
+      break;
+      
+    case HOSTREC_KERNEL:
+      if (len > sizeof(uint64_t) &&
+          trace_kernel_add(t, ((uint64_t*)hostrec->payload)[0],
+                           hostrec->payload + sizeof(uint64_t)) == 0) {
+        return 1;
+      }
+      break;
+      
+    case HOSTREC_LAUNCH:
+      if (len >= HOSTREC_LAUNCH_UNIT * sizeof(uint64_t)) {
+        trace_launch_t launch;
+        launch_deserialize((const uint64_t*)hostrec->payload, &launch);
+        if (launch.kernid <= t->kernel_count) {
+          t->launches[launch.kernid] = launch;
+        }
+      }
+      break;
+      
+    case HOSTREC_SAMPLING:
+      if (len >= 2 * sizeof(uint64_t) && ((uint64_t*)hostrec->payload)[1] != 0) {
+        t->sampling_div = ((uint64_t*)hostrec->payload)[1];
+      }
+      break;
+      
+    default:
+      break;
+    }
+
+    trace_last_error = NULL;
+    return 0;
+  }
+
   static int trace_next(trace_t* t) {
     uint8_t buf[RECORD_SIZE_MAX]; // mem space for addr_len == threads per warp
     // end of file, this is not an error
-    if (! tracefile_read(t->tracefile, buf, RECORD_HEADER_SIZE)) {
+    if (! tracefile_read(t->tracefile, buf, RECORD_HEADER_UNIT_SIZE)) {
+      trace_last_error = t->tracefile->shm_overrun
+        ? "shared memory ring overrun" : NULL;
+      return 1;
+    }
+
+    if (RECORD_IS_HOSTREC(buf)) {
+      return hostrec_next(t, buf);
+    }
+    t->hostrec.type = HOSTREC_NONE;
+
+    if (RECORD_GET_KIND(buf) == RECORD_KIND_THREAD) {
+      if (! tracefile_read(t->tracefile, buf + RECORD_HEADER_UNIT_SIZE,
+                           RECORD_THREAD_SIZE - RECORD_HEADER_UNIT_SIZE)) {
+        trace_last_error = "unable to read record";
+        return 1;
+      }
+      trace_deserialize(buf, t, 0);
       trace_last_error = NULL;
+      return 0;
+    }
+
+    if (! tracefile_read(t->tracefile, buf + RECORD_HEADER_UNIT_SIZE,
+                         RECORD_HEADER_SIZE - RECORD_HEADER_UNIT_SIZE)) {
+      trace_last_error = "unable to read record";
       return 1;
     }
 
@@ -705,13 +1521,18 @@ static inline double rttclock()
     for (uint64_t i_kern = 1; i_kern <= t->kernel_count; i_kern++) {
       
       trace_header_kernel_t* kern_header = t->kernel_accdat[i_kern];
-      for (uint64_t i_inst = 0; i_inst < kern_header->insts_count; i_inst++) {
+      if (kern_header == &empty_kernel)
+        continue;
+      for (uint64_t i_inst = 1; i_inst <= kern_header->insts_count; i_inst++) {
         free((char*)kern_header->insts[i_inst].filename);
       }
       
       free(kern_header);
     }
     free(t->kernel_accdat);
+    free(t->hostrec.payload);
+    free(t->allocs);
+    free(t->launches);
 
     if (t->tracefile->file != STDIN_FILENO)
       tracefile_close(t->tracefile);
@@ -723,6 +1544,153 @@ static inline double rttclock()
 
   
 
+  // convert a device clock of a record to the host CLOCK_MONOTONIC (ns),
+  // using the latest calibration pair read so far
+  static inline uint64_t trace_clock_to_host(const trace_t* t, uint64_t clock) {
+    return clock - t->clock_calib.gpu_time + t->clock_calib.host_time;
+  }
+
+  // get the aggregation table of the current host record;
+  // returns 1 if it is not a (valid) HOSTREC_AGGREGATE
+  static int trace_get_aggregate(const trace_t* t, trace_aggregate_t* agg) {
+    const trace_hostrec_t* hostrec = &t->hostrec;
+    if (hostrec->type != HOSTREC_AGGREGATE ||
+        hostrec->len < HOSTREC_TABLE_PREFIX_SIZE) {
+      return 1;
+    }
+
+    const uint64_t* payload = (const uint64_t*) hostrec->payload;
+    uint64_t insts_count = payload[1];
+    if ((hostrec->len - HOSTREC_TABLE_PREFIX_SIZE) / sizeof(uint64_t) / AGG_ENTRY_UNIT
+        < insts_count + 1) {
+      trace_last_error = "aggregation table too short";
+      return 1;
+    }
+
+    agg->kernid = payload[0];
+    agg->insts_count = insts_count;
+    agg->entries = payload + HOSTREC_TABLE_PREFIX_SIZE / sizeof(uint64_t);
+    return 0;
+  }
+
+  // find the allocation live at the current position of the trace, which
+  // contains addr; returns NULL if addr is not in any traced allocation
+  static inline const trace_alloc_t* trace_find_alloc(const trace_t* t,
+                                                      uint64_t addr) {
+    uint64_t i = alloc_upper_bound(t, addr);
+    if (i == 0)
+      return NULL;
+    
+    const trace_alloc_t* alloc = &t->allocs[i-1];
+    return (addr - alloc->base < alloc->size) ? alloc : NULL;
+  }
+
+  // get the memory transfer / set of the current host record;
+  // returns 1 if it is not a (valid) HOSTREC_MEMOP
+  static int trace_get_memop(const trace_t* t, trace_memop_t* memop) {
+    const trace_hostrec_t* hostrec = &t->hostrec;
+    if (hostrec->type != HOSTREC_MEMOP ||
+        hostrec->len < HOSTREC_MEMOP_UNIT * sizeof(uint64_t)) {
+      return 1;
+    }
+
+    const uint64_t* payload = (const uint64_t*) hostrec->payload;
+    memop->host_begin = payload[0];
+    memop->host_end = payload[1];
+    memop->kind = (uint32_t) payload[2];
+    memop->direction = (uint32_t) payload[3];
+    memop->dst = payload[4];
+    memop->src = payload[5];
+    memop->size = payload[6];
+    memop->stream = payload[7];
+    return 0;
+  }
+
+  // get the kernel launch of the current host record (grid and CTA dims,
+  // stream, launch sequence number); returns 1 if it is not a (valid)
+  // HOSTREC_LAUNCH
+  static int trace_get_launch(const trace_t* t, trace_launch_t* launch) {
+    const trace_hostrec_t* hostrec = &t->hostrec;
+    if (hostrec->type != HOSTREC_LAUNCH ||
+        hostrec->len < HOSTREC_LAUNCH_UNIT * sizeof(uint64_t)) {
+      return 1;
+    }
+
+    launch_deserialize((const uint64_t*)hostrec->payload, launch);
+    return 0;
+  }
+
+  // returns 1 if it is not a (valid) HOSTREC_MARKER
+  static int trace_get_marker(const trace_t* t, trace_marker_t* marker) {
+    const trace_hostrec_t* hostrec = &t->hostrec;
+    if (hostrec->type != HOSTREC_MARKER ||
+        hostrec->len < HOSTREC_MARKER_UNIT * sizeof(uint64_t)) {
+      return 1;
+    }
+
+    const uint64_t* payload = (const uint64_t*)hostrec->payload;
+    marker->host_time = payload[0];
+    marker->kind = (uint32_t) payload[1];
+    memcpy(marker->name, payload + 2, HOSTREC_MARKER_NAME_MAX);
+    marker->name[HOSTREC_MARKER_NAME_MAX] = '\0';
+    return 0;
+  }
+
+  // returns 1 if it is not a (valid) HOSTREC_LAUNCH_SAMPLING
+  static int trace_get_launch_sampling(const trace_t* t,
+                                       trace_launch_sampling_t* sampling) {
+    const trace_hostrec_t* hostrec = &t->hostrec;
+    if (hostrec->type != HOSTREC_LAUNCH_SAMPLING ||
+        hostrec->len < HOSTREC_LAUNCH_SAMPLING_UNIT * sizeof(uint64_t)) {
+      return 1;
+    }
+
+    const uint64_t* payload = (const uint64_t*)hostrec->payload;
+    sampling->host_time = payload[0];
+    sampling->kernid = (uint32_t) payload[1];
+    sampling->launches = payload[2];
+    sampling->skipped = payload[3];
+    sampling->first = payload[4];
+    sampling->every = payload[5];
+    sampling->from = payload[6];
+    sampling->to = payload[7];
+    return 0;
+  }
+
+  // latest launch of a kernel at the current position
+  // (all zero if no launch of the kernel has been read yet)
+  static inline const trace_launch_t* trace_kernel_launch(const trace_t* t,
+                                                          uint64_t kernid) {
+    return &t->launches[kernid <= t->kernel_count ? kernid : 0];
+  }
+
+  // returns 1 if it is not a (valid) HOSTREC_KERNEL_STAT
+  static int trace_get_kernel_stat(const trace_t* t, trace_kernel_stat_t* kstat) {
+    const trace_hostrec_t* hostrec = &t->hostrec;
+    if (hostrec->type != HOSTREC_KERNEL_STAT ||
+        hostrec->len < HOSTREC_TABLE_PREFIX_SIZE) {
+      return 1;
+    }
+
+    const uint64_t* payload = (const uint64_t*) hostrec->payload;
+    uint64_t field_count = payload[1];
+    if ((hostrec->len - HOSTREC_TABLE_PREFIX_SIZE) / sizeof(uint64_t)
+        < field_count) {
+      trace_last_error = "kernel stat table too short";
+      return 1;
+    }
+    
+    // fields unknown to the writer read as 0
+    const uint64_t* fields = payload + HOSTREC_TABLE_PREFIX_SIZE / sizeof(uint64_t);
+    kstat->kernid = payload[0];
+    kstat->stall_ns = (field_count > KSTAT_STALL_NS) ? fields[KSTAT_STALL_NS] : 0;
+    kstat->stall_count =
+      (field_count > KSTAT_STALL_COUNT) ? fields[KSTAT_STALL_COUNT] : 0;
+    return 0;
+  }
+
+  
+
 /**********
  * writer *
  **********/
@@ -738,6 +1706,20 @@ static inline double rttclock()
     return tracefile;
   }
   
+  // filename NULL: the trace is passed to the sink only
+  static tracefile_t trace_write_open_sink(const char* filename,
+                                           tracefile_sink_t sink,
+                                           void* sink_arg) {
+    
+    tracefile_t tracefile = tracefile_open_sink(filename, sink, sink_arg);
+    
+    if (tracefile == NULL) {
+      trace_last_error = "file create error";
+    }
+
+    return tracefile;
+  }
+  
   static int trace_write_header(tracefile_t tracefile, const void* accdat, uint64_t accdat_len) {
   
     if (! tracefile_write(tracefile, TRACE_HEADER_PREFIX, sizeof(TRACE_HEADER_PREFIX))) {
@@ -745,6 +1727,12 @@ static inline double rttclock()
       return 1;
     }
 
+    uint64_t version = TRACE_FORMAT_VERSION;
+    if (! tracefile_write(tracefile, &version, sizeof(version))) {
+      trace_last_error = "header version write error";
+      return 1;
+    }
+
     if (! tracefile_write(tracefile, &accdat_len, sizeof(accdat_len))) {
       trace_last_error = "header length write error";
       return 1;
@@ -764,31 +1752,107 @@ static inline double rttclock()
     return 0;
   }
 
-  static int trace_write_kernel(tracefile_t tracefile, const char* name,
-                                uint64_t grid_dim, uint16_t cta_size) {
+  static int trace_write_hostrec(tracefile_t tracefile, uint32_t type,
+                                 const void* payload, uint64_t len) {
     
-    uint8_t name_len = strlen(name) & 0xFF;
-    uint64_t header = ((uint64_t)name_len << 48) | ((uint64_t)cta_size << 32);
+    static const byte padding[sizeof(uint64_t)] = {0};
+    uint64_t header[HOSTREC_HEADER_UNIT] = {
+      HOSTREC_SET_HEADER_0(type),
+      HOSTREC_SET_HEADER_1(len)
+    };
+
+    if (! tracefile_write(tracefile, header, sizeof(header)) ||
+        ! tracefile_write(tracefile, payload, len) ||
+        ! tracefile_write(tracefile, padding, HOSTREC_PAYLOAD_SIZE(len) - len)) {
+      trace_last_error = "host record write error";
+      return 1;
+    }
 
-    uint8_t write_size = sizeof(header) + sizeof(grid_dim) + name_len;
-    uint8_t* write_buf = (uint8_t*) malloc(write_size);
-    uint8_t* buf_ptr = write_buf;
-    memcpy(buf_ptr, &header, sizeof(header));
-    buf_ptr += sizeof(header);
-    memcpy(buf_ptr, &grid_dim, sizeof(grid_dim));
-    buf_ptr += sizeof(grid_dim);
-    memcpy(buf_ptr, name, name_len);
+    trace_last_error = NULL;
+    return 0;
+  }
 
-    if (! tracefile_write(tracefile, write_buf, write_size)) {
-      trace_last_error = "write error";
+  static int trace_write_kernel(tracefile_t tracefile, uint64_t kernid,
+                                const void* kdata, uint64_t kdata_len) {
+    static const byte padding[sizeof(uint64_t)] = {0};
+    uint64_t len = sizeof(kernid) + kdata_len;
+    uint64_t header[HOSTREC_HEADER_UNIT] = {
+      HOSTREC_SET_HEADER_0(HOSTREC_KERNEL),
+      HOSTREC_SET_HEADER_1(len)
+    };
+
+    if (! tracefile_write(tracefile, header, sizeof(header)) ||
+        ! tracefile_write(tracefile, &kernid, sizeof(kernid)) ||
+        ! tracefile_write(tracefile, kdata, kdata_len) ||
+        ! tracefile_write(tracefile, padding, HOSTREC_PAYLOAD_SIZE(len) - len)) {
+      trace_last_error = "host record write error";
       return 1;
     }
-    
-    free(write_buf);
-    trace_last_error = NULL;
 
+    trace_last_error = NULL;
     return 0;
   }
+
+  static int trace_write_clock_calib(tracefile_t tracefile,
+                                     uint64_t gpu_time, uint64_t host_time) {
+    uint64_t payload[2] = {gpu_time, host_time};
+    return trace_write_hostrec(tracefile, HOSTREC_CLOCK_CALIB,
+                               payload, sizeof(payload));
+  }
+
+  static int trace_write_alloc(tracefile_t tracefile, uint64_t host_time,
+                               uint64_t base, uint64_t size, uint32_t kind,
+                               uint64_t call_site) {
+    uint64_t payload[HOSTREC_ALLOC_UNIT] = {host_time, base, size, kind, call_site};
+    return trace_write_hostrec(tracefile, HOSTREC_ALLOC,
+                               payload, sizeof(payload));
+  }
+
+  static int trace_write_memop(tracefile_t tracefile, const trace_memop_t* memop) {
+    uint64_t payload[HOSTREC_MEMOP_UNIT] = {
+      memop->host_begin, memop->host_end, memop->kind, memop->direction,
+      memop->dst, memop->src, memop->size, memop->stream
+    };
+    return trace_write_hostrec(tracefile, HOSTREC_MEMOP,
+                               payload, sizeof(payload));
+  }
+
+  static int trace_write_launch(tracefile_t tracefile, const trace_launch_t* launch) {
+    uint64_t payload[HOSTREC_LAUNCH_UNIT] = {
+      launch->host_time, launch->kernid, launch->seq,
+      ((uint64_t)launch->grid_dim.y << 32) | launch->grid_dim.x, launch->grid_dim.z,
+      ((uint64_t)launch->cta_dim.y << 32) | launch->cta_dim.x, launch->cta_dim.z,
+      launch->shared_mem, launch->stream
+    };
+    return trace_write_hostrec(tracefile, HOSTREC_LAUNCH,
+                               payload, sizeof(payload));
+  }
+
+  static int trace_write_marker(tracefile_t tracefile, uint64_t host_time,
+                                uint32_t kind, const char* name) {
+    uint64_t payload[HOSTREC_MARKER_UNIT] = {host_time, kind};
+    strncpy((char*)(payload + 2), name, HOSTREC_MARKER_NAME_MAX);
+    return trace_write_hostrec(tracefile, HOSTREC_MARKER,
+                               payload, sizeof(payload));
+  }
+
+  static int trace_write_launch_sampling(tracefile_t tracefile,
+                                         const trace_launch_sampling_t* sampling) {
+    uint64_t payload[HOSTREC_LAUNCH_SAMPLING_UNIT] = {
+      sampling->host_time, sampling->kernid,
+      sampling->launches, sampling->skipped,
+      sampling->first, sampling->every, sampling->from, sampling->to
+    };
+    return trace_write_hostrec(tracefile, HOSTREC_LAUNCH_SAMPLING,
+                               payload, sizeof(payload));
+  }
+
+  static int trace_write_sampling(tracefile_t tracefile,
+                                  uint64_t host_time, uint32_t divisor) {
+    uint64_t payload[2] = {host_time, divisor};
+    return trace_write_hostrec(tracefile, HOSTREC_SAMPLING,
+                               payload, sizeof(payload));
+  }
   
   static int trace_write_close(tracefile_t tracefile) {
     return tracefile_close(tracefile);
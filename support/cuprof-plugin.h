@@ -0,0 +1,72 @@
+#ifndef __CUPROF_PLUGIN_H__
+#define __CUPROF_PLUGIN_H__
+
+/***
+ **
+ **  Analysis plugin interface of the CUPROF runtime (libcuprofhost)
+ **
+ **  A plugin is a shared object listed in CUPROF_PLUGINS, which
+ **  exports cuprof_plugin(). The runtime passes it the trace of each
+ **  device as it is drained, in the trace file format (trace-io.h),
+ **  so that analyses run online, with or without the trace files.
+ **
+ **/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+  typedef struct {
+
+/****************************************************
+ *  void* open(device, trace_name);
+ *
+ *  Called when the runtime starts tracing a device, with the name
+ *  of its trace file (whether it is written or not).
+ *  Returns the state of the plugin for the device, passed to write()
+ *  and close(); NULL skips the device.
+ */
+    void* (*open)(int device, const char* trace_name);
+
+/****************************************************
+ *  int write(state, data, size);
+ *
+ *  Called with each chunk of the trace of the device, in order,
+ *  on the consumer thread of the device; the first chunk starts
+ *  with the trace header. Chunks end at any byte, so a record may
+ *  continue in the next chunk. data is valid only during the call,
+ *  and tracing of the device waits for the call.
+ *  Returns 0 on error, which is reported by the runtime.
+ */
+    int (*write)(void* state, const void* data, size_t size);
+
+/****************************************************
+ *  void close(state);
+ *
+ *  Called after the last chunk of the device, at exit.
+ */
+    void (*close)(void* state);
+
+  } cuprof_plugin_t;
+
+
+// name of the function exported by plugins
+#define CUPROF_PLUGIN_SYMBOL "cuprof_plugin"
+
+/****************************************************
+ *  const cuprof_plugin_t* cuprof_plugin();
+ *
+ *  Exported by each plugin; called once when the runtime loads it.
+ *  The returned table must stay valid until exit.
+ */
+  typedef const cuprof_plugin_t* (*cuprof_plugin_func_t)(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
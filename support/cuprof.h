@@ -0,0 +1,131 @@
+#ifndef __CUPROF_H__
+#define __CUPROF_H__
+
+/***
+ **
+ **  Host API of the CUPROF runtime (libcuprofhost)
+ **
+ **  Applications built with the cuprof plugin can include this
+ **  header to control tracing at runtime.
+ **
+ **/
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// max number of address ranges of cuprofSetAddrRanges()
+#define CUPROF_ADDR_RANGE_MAX (8)
+
+  typedef struct {
+    const void* base;
+    size_t size;
+  } cuprof_addr_range_t;
+
+
+/****************************************************
+ *  int cuprofSetAddrRanges(ranges, count);
+ *
+ *  Trace only global memory accesses in [base, base + size)
+ *  of any of the ranges, on all devices. count 0 traces all.
+ *  Replaces the ranges set by CUPROF_ADDR_RANGES.
+ *  Returns 0 on success, -1 if count exceeds CUPROF_ADDR_RANGE_MAX.
+ */
+  int cuprofSetAddrRanges(const cuprof_addr_range_t* ranges, unsigned int count);
+
+
+// max number of kernels of cuprofSetFilter()
+#define CUPROF_KERNEL_FILTER_MAX (16)
+
+// max length of marker names; longer names are truncated
+#define CUPROF_MARKER_NAME_MAX (48)
+
+
+/****************************************************
+ *  int cuprofStart();
+ *  int cuprofStop();
+ *
+ *  Enable / disable tracing on all devices. Kernels check it when
+ *  their threads start, so kernels already running are not affected;
+ *  synchronize before the call for exact boundaries.
+ *  While stopped, instrumented kernels skip all trace calls, or run
+ *  their uninstrumented copy if built with the plugin argument "dual".
+ *  Tracing starts enabled, unless CUPROF_ENABLED=0.
+ *  Each call writes a marker to the traces. Returns 0.
+ */
+  int cuprofStart(void);
+  int cuprofStop(void);
+
+
+/****************************************************
+ *  int cuprofFlush();
+ *
+ *  Wait for all devices, then write out everything traced so far
+ *  to the trace files.
+ *  Returns 0 on success, -1 if a device failed to synchronize.
+ */
+  int cuprofFlush(void);
+
+
+/****************************************************
+ *  int cuprofDump();
+ *
+ *  Flight recorder (CUPROF_FLIGHT_RECORDER): wait for all devices,
+ *  then write the trace history of each device to a new trace file,
+ *  "<trace file name>-flight-<n>.trc".
+ *  Returns 0 on success, -1 if the flight recorder is off or a device
+ *  failed to synchronize.
+ */
+  int cuprofDump(void);
+
+
+/****************************************************
+ *  int cuprofSetFilter(kernel_names, count);
+ *
+ *  Trace only the kernels of the given names (as in the traces),
+ *  on all devices. count 0 traces all kernels.
+ *  Returns 0 on success, -1 if a name is not an instrumented kernel
+ *  or more than CUPROF_KERNEL_FILTER_MAX kernels match.
+ */
+  int cuprofSetFilter(const char* const* kernel_names, unsigned int count);
+
+
+  typedef struct {
+    unsigned long long first;  // first launches traced
+    unsigned long long every;  // then every <every>th launch traced
+    unsigned long long from;   // first launch of the range (0: launch 1)
+    unsigned long long to;     // last launch of the range (0: no limit)
+  } cuprof_launch_sampling_t;
+
+
+/****************************************************
+ *  int cuprofSetLaunchSampling(policy);
+ *
+ *  Trace only some launches of each kernel, counted per kernel from 1:
+ *  within launches [from, to], the first <first> launches and then
+ *  every <every>th launch, or all launches of the range if both are 0.
+ *  E.g. {2, 100, 0, 0} traces launches 1, 2, 100, 200, ...
+ *  NULL traces all launches. Replaces CUPROF_LAUNCH_SAMPLING.
+ *  Returns 0.
+ */
+  int cuprofSetLaunchSampling(const cuprof_launch_sampling_t* policy);
+
+
+/****************************************************
+ *  int cuprofMarker(name);
+ *
+ *  Write a named marker with the host time to the traces of all devices,
+ *  e.g. to delimit iterations.
+ *  Returns 0 on success, -1 if name is NULL.
+ */
+  int cuprofMarker(const char* name);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -83,31 +83,378 @@ extern "C" {
   
   
 
+// backoff bounds of BACKPRESSURE_SLEEP / BACKPRESSURE_YIELD (ns)
+#define BACKOFF_MIN_NS (64)
+#define BACKOFF_MAX_NS (16384)
+#define BACKOFF_YIELD_NS (BACKOFF_MIN_NS)
+
+// slots probed by BACKPRESSURE_HANDOFF, including the home slot
+#define HANDOFF_PROBE_COUNT (4)
+
+  
+
+// slot pointers a record is written to
+  typedef struct {
+    uint32_t* alloc;
+    uint32_t* commit;
+    uint32_t* flushed;
+    uint32_t* signal;
+    uint8_t* records;
+  } trace_slot_t;
+
+  
+
+/****************************************************
+ *  TRACE_CTX_LOAD(ctx);
+ *
+ *  Load the per-thread constants of the trace context,
+ *  and read SM / physical warp ids of the current site.
+ */
+#define TRACE_CTX_LOAD(ctx)                             \
+  uint64_t grid = (ctx)->grid;                          \
+  uint64_t ctaid_serial = (ctx)->cta_serial;            \
+  uint32_t warpv = (ctx)->warpv;                        \
+  uint32_t laneid = (ctx)->laneid;                      \
+  uint32_t kernid = (ctx)->kernid;                      \
+  uint32_t sm;                                          \
+  uint32_t warpp;                                       \
+  asm volatile ("mov.u32 %0, %%smid;" : "=r"(sm));      \
+  asm volatile ("mov.u32 %0, %%warpid;" : "=r"(warpp))
+
+  
+
+/****************************************************
+ *  uint64_t ___cuprof_globaltimer();
+ *
+ *  Read the global nanosecond timer.
+ *  Unlike clock64(), it is comparable across SMs.
+ */
+  static __device__ __forceinline__ uint64_t ___cuprof_globaltimer() {
+    uint64_t timer;
+    asm volatile ("mov.u64 %0, %%globaltimer;" : "=l"(timer));
+    return timer;
+  }
+
+  
+
+/****************************************************
+ *  void ___cuprof_set_header_0();
+ *
+ *  Replace zero header words with non-zero, and set the
+ *  first header word with the nonzero mask for the host.
+ *  nonzero_mask_data is indexed by the writing lane.
+ */
+  static __device__ __forceinline__ void ___cuprof_set_header_0(uint64_t* header_info,
+                                                                int header_unit,
+                                                                uint32_t nonzero_mask_data,
+                                                                uint32_t kind,
+                                                                uint32_t warpv) {
+#ifndef CUPROF_RMSYNC_DISABLE
+    
+    uint64_t nonzero_mask_header = LLGT_BIT_MASK(header_unit);
+
+    // header part zero mask
+    for (int i = 0; i < header_unit; i++) {
+      if (header_info[i] == 0) {
+        header_info[i] = -1; // set to non-zero, if header is zero
+        nonzero_mask_header ^= ((uint64_t)1 << i); // make zero part to bit 0
+      }
+    }
+
+    // header part + data part
+    uint64_t nonzero_mask = nonzero_mask_header |
+      ((uint64_t)nonzero_mask_data << header_unit); // append
+    
+    header_info[0] = RECORD_SET_HEADER_0(nonzero_mask, kind, warpv);
+    
+#else
+    
+    header_info[0] = RECORD_SET_HEADER_0(-1, kind, warpv);
+
+#endif
+  }
+
+
+
+/****************************************************
+ *  uint32_t ___cuprof_addr_in_ranges();
+ *
+ *  Check if the address is in any of the address ranges
+ *  set by the host (always true if no range is set).
+ *  A single unsigned compare per range.
+ */
+  static __device__ __forceinline__ uint32_t ___cuprof_addr_in_ranges(trace_ctx_t* ctx,
+                                                                      uint64_t addr) {
+    volatile uint64_t* table = ctx->info->addr_ranges_d;
+    uint32_t count = table[0];
+    if (count == 0)
+      return 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (addr - table[1 + 2*i] < table[2 + 2*i])
+        return 1;
+    }
+    return 0;
+  }
+
+
+
+/****************************************************
+ *  uint32_t ___cuprof_sample_skip();
+ *
+ *  Check if the record of the warp is dropped by the sampling
+ *  divisor published by the host. The decision is taken from
+ *  the leader, so that it is uniform across the active lanes.
+ */
+  static __device__ __forceinline__ uint32_t ___cuprof_sample_skip(trace_ctx_t* ctx,
+                                                                   uint32_t active,
+                                                                   uint32_t laneid_leader,
+                                                                   uint32_t instid,
+                                                                   uint64_t clock) {
+    uint32_t divisor = *(volatile uint32_t*) ctx->info->sampling_d;
+    divisor = __shfl_sync(active, divisor, laneid_leader);
+    if (divisor <= 1)
+      return 0;
+
+    // mix the site and time of the leader
+    uint64_t key = __shfl_sync(active, clock, laneid_leader);
+    key ^= ((uint64_t)instid << 32) ^ ctx->warpv;
+    key ^= ctx->cta_serial * 0x9E3779B97F4A7C15ULL;
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    
+    return (key % divisor) != 0;
+  }
+
+
+
+/****************************************************
+ *  void ___cuprof_backoff();
+ *
+ *  Wait for about ns nanoseconds, leaving the issue slots
+ *  and memory bandwidth of the SM to the other warps.
+ */
+  static __device__ __forceinline__ void ___cuprof_backoff(uint32_t ns) {
+#if __CUDA_ARCH__ >= 700
+    __nanosleep(ns);
+#else
+    uint64_t start = ___cuprof_globaltimer();
+    while (___cuprof_globaltimer() - start < ns);
+#endif
+  }
+
+
+
+/****************************************************
+ *  uint32_t ___cuprof_slot_handoff();
+ *
+ *  Pick a slot with room for the record, probing the slots
+ *  next to the home slot. Falls back to the home slot if
+ *  none of them has room.
+ *  Room is judged by the flushed counters last seen on the
+ *  device, which may lag behind those of the host.
+ */
+  static __device__ __forceinline__ uint32_t ___cuprof_slot_handoff(traceinfo_t* info,
+                                                                    uint32_t slot_home,
+                                                                    uint32_t record_size) {
+    uint32_t slot_count = info->slot_count;
+    uint32_t probe_count = min(slot_count, (uint32_t)HANDOFF_PROBE_COUNT);
+
+    for (uint32_t i = 0; i < probe_count; i++) {
+      uint32_t slot_i = (slot_home + i) % slot_count;
+      uint32_t alloc_cur =
+        *(volatile uint32_t*) (info->allocs_d + slot_i * CACHELINE);
+      uint32_t flushed_cur =
+        *(volatile uint32_t*) (info->flusheds_seen_d + slot_i * CACHELINE);
+      
+      if ((alloc_cur + record_size - flushed_cur) < SLOT_SIZE - RECORD_SIZE_MAX)
+        return slot_i;
+    }
+
+    return slot_home;
+  }
+
+
+
+/****************************************************
+ *  uint32_t ___cuprof_slot_alloc();
+ *
+ *  Allocate space for a record in a slot, and wait until
+ *  the space is not full, as selected by the backpressure
+ *  policy. Time spent waiting is added to the kernel stats.
+ *  Must be called by all active lanes; the leader allocates.
+ *  Returns the record offset in the slot, and sets the
+ *  pointers of the slot.
+ */
+  static __device__ __forceinline__ uint32_t ___cuprof_slot_alloc(trace_ctx_t* ctx,
+                                                                  trace_slot_t* slot,
+                                                                  uint32_t active,
+                                                                  uint32_t laneid_leader,
+                                                                  uint32_t record_size,
+                                                                  uint32_t* flushed_cur) {
+    traceinfo_t* info = ctx->info;
+    uint32_t slot_i = ctx->slot;
+    uint32_t rec_offset;
+
+    if (ctx->laneid == laneid_leader) {
+      uint32_t policy = info->backpressure;
+      
+      if (policy == BACKPRESSURE_HANDOFF)
+        slot_i = ___cuprof_slot_handoff(info, slot_i, record_size);
+      
+      volatile uint32_t* flushed_v =
+        (uint32_t*) (info->flusheds_d + slot_i * CACHELINE);
+      volatile uint32_t* flushed_seen_v =
+        (uint32_t*) (info->flusheds_seen_d + slot_i * CACHELINE);
+    
+      // get the allocated offset
+      uint32_t alloc_raw =
+        atomicAdd((uint32_t*) (info->allocs_d + slot_i * CACHELINE), record_size);
+
+      // wait until slot is not full.
+      // flusheds_d may be mapped host memory, so it is read only
+      // when the flushed counter last seen says the slot is full.
+      *flushed_cur = *flushed_seen_v;
+      if ((alloc_raw - *flushed_cur) >= SLOT_SIZE - RECORD_SIZE_MAX) {
+        *flushed_cur = *flushed_v;
+        
+        if ((alloc_raw - *flushed_cur) >= SLOT_SIZE - RECORD_SIZE_MAX) {
+          uint64_t stall_start = ___cuprof_globaltimer();
+          uint32_t backoff = BACKOFF_MIN_NS;
+        
+          do {
+            if (policy == BACKPRESSURE_SLEEP) {
+              ___cuprof_backoff(backoff);
+              backoff = min(backoff * 2, (uint32_t)BACKOFF_MAX_NS);
+            } else if (policy == BACKPRESSURE_YIELD) {
+              ___cuprof_backoff(BACKOFF_YIELD_NS);
+            }
+            *flushed_cur = *flushed_v;
+          } while ((alloc_raw - *flushed_cur) >= SLOT_SIZE - RECORD_SIZE_MAX);
+
+          unsigned long long* kstat = (unsigned long long*) ctx->kstat;
+          atomicAdd(kstat + KSTAT_STALL_NS, ___cuprof_globaltimer() - stall_start);
+          atomicAdd(kstat + KSTAT_STALL_COUNT, 1);
+        }
+
+        *flushed_seen_v = *flushed_cur;
+      }
+      
+      rec_offset = alloc_raw % SLOT_SIZE;
+    }
+
+    slot_i = __shfl_sync(active, slot_i, laneid_leader);
+    rec_offset = __shfl_sync(active, rec_offset, laneid_leader);
+
+    slot->alloc = (uint32_t*) (info->allocs_d + slot_i * CACHELINE);
+    slot->commit = (uint32_t*) (info->commits_d + slot_i * CACHELINE);
+    slot->flushed = (uint32_t*) (info->flusheds_d + slot_i * CACHELINE);
+    slot->signal = (uint32_t*) (info->signals_d + slot_i * CACHELINE);
+    slot->records = info->records_d + (uint64_t)slot_i * SLOT_SIZE;
+
+    return rec_offset;
+  }
+
+
+
+/****************************************************
+ *  void ___cuprof_slot_write_header();
+ *
+ *  Write the record header (header_unit words) at rec_offset
+ *  of the slot, spread over the active lanes.
+ */
+  static __device__ __forceinline__ void ___cuprof_slot_write_header(uint8_t* records,
+                                                                     uint32_t rec_offset,
+                                                                     uint64_t* header_info,
+                                                                     int header_unit,
+                                                                     uint32_t laneid_among_active,
+                                                                     uint32_t active_count) {
+#ifndef CUPROF_CRW_DISABLE
+
+    for (int i = laneid_among_active; i < header_unit; i += active_count) {
+      int rec_i = (rec_offset + sizeof(uint64_t)*i) % SLOT_SIZE;
+      *(volatile uint64_t*)(records + rec_i) = header_info[i];
+    }
+
+#else
+    
+    if (laneid_among_active == 0) {
+      for (int i = 0; i < header_unit; i++) {
+        int rec_i = (rec_offset + sizeof(uint64_t)*i) % SLOT_SIZE;
+        *(volatile uint64_t*)(records + rec_i) = header_info[i];
+      }
+    }
+
+#endif
+  }
+
+
+
+/****************************************************
+ *  void ___cuprof_slot_commit();
+ *
+ *  Commit the written record, and send flush signal to the host
+ *  if a flush unit of the slot is filled.
+ *  Called by the warp leader only.
+ */
+  static __device__ __forceinline__ void ___cuprof_slot_commit(uint32_t* commit,
+                                                               uint32_t* signal,
+                                                               uint32_t flushed_cur,
+                                                               uint32_t record_size) {
+    volatile uint32_t* signal_v = signal;
+    
+    uint32_t commit_raw = atomicAdd(commit, record_size) + record_size;
+
+#ifndef CUPROF_MULTI_BUF_DISABLE
+    uint32_t flush_unit = UNIT_SLOT_SIZE - RECORD_SIZE_MAX;
+    uint32_t flush_threshold = UNIT_SLOT_SIZE - (2*RECORD_SIZE_MAX);
+#else
+    uint32_t flush_unit = SLOT_SIZE - RECORD_SIZE_MAX;
+    uint32_t flush_threshold = SLOT_SIZE - (2*RECORD_SIZE_MAX);
+#endif
+    if (
+      ( ((commit_raw - flushed_cur - record_size) % flush_unit) >= flush_threshold )
+      &&
+      ( (commit_raw - flushed_cur) % flush_unit < flush_threshold )
+      ) {
+      // timestamp for the host to pair with its own clock
+      *(volatile uint64_t*)((uint8_t*)signal + SIGNAL_TIME_OFFSET) =
+        ___cuprof_globaltimer();
+      __threadfence_system();
+        
+      *signal_v = commit_raw; // request flush to host
+    }
+  }
+
+  
+
 /****************************************************
  *  void ___cuprof_trace();
  *
  *  Write trace data and associated info
  *  to the externally allocated areas.
  */
-  __device__ __noinline__ void ___cuprof_trace(uint32_t* alloc, uint32_t* commit,
-                                               uint32_t* flushed, uint32_t* signal,
-                                               uint8_t* records, uint64_t data,
-                                               uint64_t grid, uint64_t ctaid_serial,
-                                               uint32_t warpv, uint32_t laneid,
-                                               uint32_t instid, uint32_t kernid,
-                                               uint32_t sm, uint32_t warpp,
+  __device__ __noinline__ void ___cuprof_trace(trace_ctx_t* ctx, uint64_t data,
+                                               uint32_t instid,
                                                uint8_t to_be_traced) {
 
     if (!to_be_traced)
       return;
 
-    uint64_t clock = clock64();
+    // drop accesses outside the address ranges before any slot atomics
+    if (!___cuprof_addr_in_ranges(ctx, data))
+      return;
+
+    TRACE_CTX_LOAD(ctx);
+
+    uint64_t clock = ___cuprof_globaltimer();
 
-    volatile uint32_t* flushed_v = flushed;
-    volatile uint32_t* signal_v = signal;
-    
     uint32_t active = __activemask();
     uint32_t laneid_leader = __ffs(active)-1;
+
+    if (___cuprof_sample_skip(ctx, active, laneid_leader, instid, clock))
+      return;
     
     uint64_t data_prev_prev = __shfl_up_sync(active, data, 2);
     uint64_t data_prev = __shfl_up_sync(active, data, 1);
@@ -121,10 +468,6 @@ extern "C" {
     uint32_t rec_offset;
     uint32_t flushed_cur;
 
-    kernid = 1;
-    if (instid >= RECORD_UNKNOWN)
-      instid = 14;
-
 #ifndef CUPROF_ODE_DISABLE
 
     // check if msb is the same across all active threads
@@ -186,8 +529,9 @@ extern "C" {
     header_info[1] = RECORD_SET_HEADER_1(active, (is_msb_same ? writemask : 0)); // if msb is not same, writemask == 0
     header_info[2] = RECORD_SET_HEADER_2(ctaid_serial);
     header_info[3] = RECORD_SET_HEADER_3(grid);
-    header_info[4] = RECORD_SET_HEADER_4(warpp, sm);
-    header_info[5] = RECORD_SET_HEADER_5(msb, clock);
+    header_info[4] = RECORD_SET_HEADER_4(msb, warpp, sm);
+    header_info[5] = RECORD_SET_HEADER_5(clock);
+    header_info[6] = RECORD_SET_HEADER_6(kernid, instid);
 
     
 #ifndef CUPROF_ODE_DISABLE
@@ -198,32 +542,15 @@ extern "C" {
 #endif
 
 
-#ifndef CUPROF_RMSYNC_DISABLE
-    
     // data part nonzero mask
-    uint64_t nonzero_mask_data = __ballot_sync(active, data);
-
-    uint64_t nonzero_mask_header = LLGT_BIT_MASK(RECORD_HEADER_UNIT);
-
-    // header part zero mask
-    for (int i = 0; i < RECORD_HEADER_UNIT; i++) {
-      if (header_info[i] == 0) {
-        header_info[i] = -1; // set to non-zero, if header is zero
-        nonzero_mask_header ^= ((uint64_t)1 << i); // make zero part to bit 0
-      }
-    }
-
-    // header part + data part
-    uint64_t nonzero_mask = nonzero_mask_header |
-      ((writemask & nonzero_mask_data) << RECORD_HEADER_UNIT); // append
+    uint32_t nonzero_mask_data = __ballot_sync(active, data);
+    ___cuprof_set_header_0(header_info, RECORD_HEADER_UNIT,
+                           writemask & nonzero_mask_data,
+                           RECORD_KIND_ADDR, warpv);
     
-    header_info[0] = RECORD_SET_HEADER_0(nonzero_mask, kernid, instid, warpv);
+#ifndef CUPROF_RMSYNC_DISABLE
     if (data == 0) data = -1; // set to non-zero, if thread data is zero
     ///// need to write non-zero if msb is different
-#else
-    
-    header_info[0] = RECORD_SET_HEADER_0(-1, kernid, instid, warpv);
-
 #endif
     
 
@@ -244,44 +571,13 @@ extern "C" {
 
 
     // allocate space in slot
-    if (laneid == laneid_leader) {
+    trace_slot_t slot;
+    rec_offset = ___cuprof_slot_alloc(ctx, &slot, active, laneid_leader,
+                                      record_size, &flushed_cur);
 
-      // get the allocated offset
-      uint32_t alloc_raw = atomicAdd(alloc, record_size);
-      
-      rec_offset = alloc_raw % SLOT_SIZE;
-
-      // wait until slot is not full
-      do {
-        flushed_cur = *flushed_v;
-      } while ((alloc_raw - flushed_cur) >= SLOT_SIZE - RECORD_SIZE_MAX);
-    }
-
-
-
-    rec_offset = __shfl_sync(active, rec_offset, laneid_leader);
-
-#ifndef CUPROF_CRW_DISABLE
-
-    volatile uint64_t* rec_header = (uint64_t*) (records + rec_offset);
-
-    for (int i = laneid_among_active; i < RECORD_HEADER_UNIT; i += active_count) {
-      int rec_i = (rec_offset + sizeof(uint64_t)*i) % SLOT_SIZE;
-      *(uint64_t*)(records + rec_i) = header_info[i];
-    }
-    //////////////////////////////////////////////
-
-#else
-
-    
-    if (laneid == laneid_leader) {
-      for (int i = 0; i < RECORD_HEADER_UNIT; i++) {
-        int rec_i = (rec_offset + sizeof(uint64_t)*i) % SLOT_SIZE;
-        *(uint64_t*)(records + rec_i) = header_info[i];
-      }
-    }
-
-#endif
+    ___cuprof_slot_write_header(slot.records, rec_offset,
+                                header_info, RECORD_HEADER_UNIT,
+                                laneid_among_active, active_count);
 
 
 
@@ -292,7 +588,7 @@ extern "C" {
 
     if (is_write) {
       int rec_i = (rec_offset + RECORD_SIZE(write_pos)) % SLOT_SIZE;
-      volatile uint64_t* rec_data = (uint64_t*) (records + rec_i);
+      volatile uint64_t* rec_data = (uint64_t*) (slot.records + rec_i);
       *rec_data = data;
     }
 
@@ -317,7 +613,7 @@ extern "C" {
       for (int i = 0; i < data_count; i++) {
         
         int rec_i = (rec_offset + RECORD_SIZE(i)) % SLOT_SIZE;
-        volatile uint64_t* rec_data = (uint64_t*) (records + rec_i);
+        volatile uint64_t* rec_data = (uint64_t*) (slot.records + rec_i);
         *rec_data = data_warp[i];
       }
         
@@ -337,29 +633,248 @@ extern "C" {
 
     // commit space in slot, and send full signal to the host
     if (laneid == laneid_leader) {
-      //uint32_t write_count = __popc(writemask_final);
-      //if (write_count != 32)
-      //printf("write_count = %u\n%x\n%x\n%u\n%u\n%u\n\n%x\n%x\n%x)\n", write_count, data_prev, data_next, data_delta_prev, data_delta_next, is_delta_changed, subwritemask_1, subwritemask_2, writemask);//////////////////
-      uint32_t commit_raw = atomicAdd(commit, record_size) + record_size; //atomicInc(commit, UINT32_MAX) + 1;
-      
-      
+      ___cuprof_slot_commit(slot.commit, slot.signal, flushed_cur, record_size);
+    }
 
-#ifndef CUPROF_MULTI_BUF_DISABLE
-      uint32_t flush_unit = UNIT_SLOT_SIZE - RECORD_SIZE_MAX;
-      uint32_t flush_threshold = UNIT_SLOT_SIZE - (2*RECORD_SIZE_MAX);
-#else
-      uint32_t flush_unit = SLOT_SIZE - RECORD_SIZE_MAX;
-      uint32_t flush_threshold = SLOT_SIZE - (2*RECORD_SIZE_MAX);
+  }
+
+
+
+/****************************************************
+ *  void ___cuprof_trace_thread();
+ *
+ *  Write a fixed-size record of thread execute/return,
+ *  without per-lane data.
+ */
+  __device__ __noinline__ void ___cuprof_trace_thread(trace_ctx_t* ctx,
+                                                      uint32_t instid,
+                                                      uint8_t to_be_traced) {
+
+    if (!to_be_traced)
+      return;
+
+    TRACE_CTX_LOAD(ctx);
+
+    uint64_t clock = ___cuprof_globaltimer();
+    
+    uint32_t active = __activemask();
+    uint32_t laneid_leader = __ffs(active)-1;
+    uint32_t laneid_among_active = __popc(active & ((0x1 << laneid) - 1));
+    uint32_t active_count = __popc(active);
+
+    uint32_t rec_offset;
+    uint32_t flushed_cur;
+
+    uint64_t header_info[RECORD_THREAD_UNIT];
+    header_info[0] = 1; // ensure first elem to be non-zero
+    header_info[1] = RECORD_SET_HEADER_2(ctaid_serial);
+    header_info[2] = RECORD_SET_HEADER_3(grid);
+    header_info[3] = RECORD_SET_HEADER_4(active, warpp, sm);
+    header_info[4] = RECORD_SET_HEADER_5(clock);
+    header_info[5] = RECORD_SET_HEADER_6(kernid, instid);
+    ___cuprof_set_header_0(header_info, RECORD_THREAD_UNIT, 0,
+                           RECORD_KIND_THREAD, warpv);
+
+    
+    // allocate space in slot
+    trace_slot_t slot;
+    rec_offset = ___cuprof_slot_alloc(ctx, &slot, active, laneid_leader,
+                                      RECORD_THREAD_SIZE, &flushed_cur);
+
+    ___cuprof_slot_write_header(slot.records, rec_offset,
+                                header_info, RECORD_THREAD_UNIT,
+                                laneid_among_active, active_count);
+
+#ifdef CUPROF_RMSYNC_DISABLE
+
+    // guarantee all writes before to be written to the 'records'
+    __threadfence_system();
+    
 #endif
-      if (
-        ( ((commit_raw - flushed_cur - record_size) % flush_unit) >= flush_threshold )
-        &&
-        ( (commit_raw - flushed_cur) % flush_unit < flush_threshold )
-        ) {
-        *signal_v = commit_raw; // request flush to host
-      }
+
+    // commit space in slot, and send full signal to the host
+    if (laneid == laneid_leader) {
+      ___cuprof_slot_commit(slot.commit, slot.signal, flushed_cur,
+                            RECORD_THREAD_SIZE);
+    }
+  }
+
+
+/****************************************************
+ *  uint32_t ___cuprof_warp_unique();
+ *
+ *  Group the active lanes by key, and return the mask of
+ *  the lowest lane in each group (popc: number of unique keys).
+ *  The lanes of the group of the current lane are set to group.
+ *  Must be called by all active lanes.
+ */
+  static __device__ __forceinline__ uint32_t ___cuprof_warp_unique(uint32_t active,
+                                                                  uint64_t key,
+                                                                  uint32_t laneid,
+                                                                  uint32_t* group) {
+    uint32_t pending = active;
+    uint32_t leaders = 0;
+
+    // pending is warp-uniform, so is the loop
+    while (pending) {
+      uint32_t leader = __ffs(pending)-1;
+      uint64_t key_leader = __shfl_sync(active, key, leader);
+      uint32_t same = __ballot_sync(active, key == key_leader) & pending;
+
+      if (same & (0x1 << laneid))
+        *group = same;
+      leaders |= (0x1 << leader);
+      pending &= ~same;
+    }
+    
+    return leaders;
+  }
+
+
+  
+/****************************************************
+ *  void ___cuprof_trace_sector();
+ *
+ *  Write the unique 32B sectors of a warp-level request,
+ *  instead of the address of each thread.
+ *  Same arguments as ___cuprof_trace().
+ */
+  __device__ __noinline__ void ___cuprof_trace_sector(trace_ctx_t* ctx, uint64_t data,
+                                                      uint32_t instid,
+                                                      uint8_t to_be_traced) {
+
+    if (!to_be_traced)
+      return;
+
+    if (!___cuprof_addr_in_ranges(ctx, data))
+      return;
+
+    TRACE_CTX_LOAD(ctx);
+
+    uint64_t clock = ___cuprof_globaltimer();
+    
+    uint32_t active = __activemask();
+    uint32_t laneid_leader = __ffs(active)-1;
+
+    if (___cuprof_sample_skip(ctx, active, laneid_leader, instid, clock))
+      return;
+    
+    uint32_t lanemask = (0x1 << laneid);
+    uint32_t lanemask_prevs = lanemask - 1;
+    uint32_t laneid_among_active = __popc(active & lanemask_prevs);
+    uint32_t active_count = __popc(active);
+
+    uint32_t rec_offset;
+    uint32_t flushed_cur;
+
+    
+    // the lowest lane of each sector writes the sector
+    
+    uint32_t group;
+    uint32_t writemask = ___cuprof_warp_unique(active, data >> SECTOR_SIZE_BITS,
+                                               laneid, &group);
+    uint32_t is_write = writemask & lanemask;
+    uint32_t write_pos = __popc(writemask & lanemask_prevs);
+    uint32_t record_size = RECORD_SIZE(__popc(writemask));
+
+    data = RECORD_SET_SECTOR(data, __popc(group));
+
+    
+    // initialize record header + data
+
+    uint64_t header_info[RECORD_HEADER_UNIT];
+    header_info[0] = 1; // ensure first elem to be non-zero
+    header_info[1] = RECORD_SET_HEADER_1(active, writemask);
+    header_info[2] = RECORD_SET_HEADER_2(ctaid_serial);
+    header_info[3] = RECORD_SET_HEADER_3(grid);
+    header_info[4] = RECORD_SET_HEADER_4(0, warpp, sm);
+    header_info[5] = RECORD_SET_HEADER_5(clock);
+    header_info[6] = RECORD_SET_HEADER_6(kernid, instid);
+
+    uint32_t nonzero_mask_data = __ballot_sync(active, data);
+    ___cuprof_set_header_0(header_info, RECORD_HEADER_UNIT,
+                           writemask & nonzero_mask_data,
+                           RECORD_KIND_SECTOR, warpv);
+    
+#ifndef CUPROF_RMSYNC_DISABLE
+    if (data == 0) data = -1; // set to non-zero, if sector data is zero
+#endif
+
+    
+    // allocate space in slot
+    trace_slot_t slot;
+    rec_offset = ___cuprof_slot_alloc(ctx, &slot, active, laneid_leader,
+                                      record_size, &flushed_cur);
+
+    ___cuprof_slot_write_header(slot.records, rec_offset,
+                                header_info, RECORD_HEADER_UNIT,
+                                laneid_among_active, active_count);
+
+    if (is_write) {
+      int rec_i = (rec_offset + RECORD_SIZE(write_pos)) % SLOT_SIZE;
+      *(volatile uint64_t*) (slot.records + rec_i) = data;
+    }
+
+#ifdef CUPROF_RMSYNC_DISABLE
+
+    // guarantee all writes before to be written to the 'records'
+    __threadfence_system();
+    
+#endif
+
+    // commit space in slot, and send full signal to the host
+    if (laneid == laneid_leader) {
+      ___cuprof_slot_commit(slot.commit, slot.signal, flushed_cur, record_size);
+    }
+  }
+
+
+
+  
+/****************************************************
+ *  void ___cuprof_aggregate();
+ *
+ *  Count the access into the per-instruction entry of the
+ *  aggregation table, instead of writing a record.
+ *  req_size is 0 for non-memory instructions.
+ */
+  __device__ __noinline__ void ___cuprof_aggregate(trace_ctx_t* ctx, uint64_t data,
+                                                   uint32_t instid, uint32_t req_size,
+                                                   uint8_t to_be_traced) {
+
+    if (!to_be_traced)
+      return;
+
+    if (req_size != 0 && !___cuprof_addr_in_ranges(ctx, data))
+      return;
+
+    uint64_t* aggdat = ctx->aggdat;
+    uint32_t laneid = ctx->laneid;
+    
+    uint32_t active = __activemask();
+    uint32_t laneid_leader = __ffs(active)-1;
+    uint32_t active_count = __popc(active);
+
+    // accesses are naturally aligned, so each lane touches a single sector
+    uint32_t sector_count = 0;
+    if (req_size != 0) {
+      uint64_t sector = data >> SECTOR_SIZE_BITS;
+      uint32_t group;
+      sector_count = __popc(___cuprof_warp_unique(active, sector, laneid, &group));
     }
 
+    if (laneid == laneid_leader) {
+      unsigned long long* entry =
+        (unsigned long long*) (aggdat + (uint64_t)instid * AGG_ENTRY_UNIT);
+      
+      atomicAdd(entry + AGG_REQUESTS, 1);
+      atomicAdd(entry + AGG_ACCESSES, active_count);
+      if (req_size != 0) {
+        atomicAdd(entry + AGG_SECTORS, sector_count);
+        atomicAdd(entry + AGG_BYTES, (unsigned long long)req_size * active_count);
+      }
+      atomicAdd(entry + AGG_LANE_HIST + active_count - 1, 1);
+    }
   }
 
 
@@ -369,8 +884,7 @@ extern "C" {
  *
  *  Flush commit_v to signal (host)
  */
-  __device__ void ___cuprof_trace_ret(uint32_t* commit, uint32_t* signal,
-                                      uint32_t lane) {
+  __device__ void ___cuprof_trace_ret(trace_ctx_t* ctx) {
 /*
   return;
 
@@ -404,7 +918,9 @@ extern "C" {
  *  void ___cuprof_filter();
  *
  *  Check if current thread is to be traced,
- *  with given thread-constant vars (grid, cta, warpv).
+ *  with given thread-constant vars (grid, cta, warpv),
+ *  and the runtime control of the host (enabled, kernel filter,
+ *  launch sampling).
  *
  *  Called only once in a thread, when the thread starts.
  */
@@ -413,7 +929,28 @@ extern "C" {
                                    uint8_t filter_grid_count,
                                    uint8_t filter_cta_count,
                                    uint8_t filter_warpv_count,
-                                   uint64_t ctaid_serial, uint32_t warpv) {
+                                   uint64_t ctaid_serial, uint32_t warpv,
+                                   traceinfo_t* info, uint32_t kernid,
+                                   uint32_t launch_skip) {
+
+    // stopped, kernel not selected or launch not sampled by the host:
+    // the trace calls of the thread return right away
+    volatile uint32_t* control = info->control_d;
+    if (!control[CONTROL_ENABLED] || launch_skip) {
+      *to_be_traced = 0;
+      return;
+    }
+    uint32_t kernel_count = control[CONTROL_KERNEL_COUNT];
+    if (kernel_count != 0) {
+      uint8_t selected = 0;
+      for (uint32_t i = 0; i < kernel_count; i++)
+        if (control[CONTROL_KERNELS + i] == kernid)
+          selected = 1;
+      if (!selected) {
+        *to_be_traced = 0;
+        return;
+      }
+    }
 
     uint64_t grid;
     asm volatile ("mov.u64 %0, %%gridid;" : "=l"(grid));
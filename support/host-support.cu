@@ -1,12 +1,17 @@
 #include "../lib/common.h"
 #include "../lib/trace-io.h"
+#include "cuprof.h"
+#include "cuprof-plugin.h"
 
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <algorithm>
+#include <deque>
+#include <map>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <string.h>
@@ -14,6 +19,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <time.h>
 
 //*******************
 //int32_t count_stats[100000] = {0};
@@ -40,6 +48,12 @@ static inline long long rtclocku()
   return Tp.tv_usec + Tp.tv_sec*1.0e+6;
 }
 
+static inline uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 //***************
 #define always_assert(cond) do {                        \
     if (!(cond)) {                                      \
@@ -58,12 +72,417 @@ static inline long long rtclocku()
   } while(0)
 
 extern "C" {
-  static char* ___cuprof_accdat_var = NULL;
-  static uint64_t ___cuprof_accdat_varlen = 0;
-  static uint32_t ___cuprof_kernel_count = 0;
+  // kernels set up so far, published after their kernel infos
+  static std::atomic<uint32_t> ___cuprof_kernel_count(0);
   
   traceinfo_t* ___cuprof_trace_base_info = NULL;
 }
+
+/*******************************************************************************
+ * Kernels set up by global ctors, indexed by kernel id.
+ * Constructed on first use, as ctors of other modules may run before the
+ * static initializers of this one.
+ * Modules may be set up while kernels of others are launched (dlopen), so
+ * the tables only grow under kernelsMutex(). Kernel infos keep their
+ * address, and are used through kernelInfo() without holding the mutex.
+ */
+typedef struct kernel_info_t {
+  bool aggregated;
+  size_t aggdat_size;      // aggregation table in the launch data, in bytes
+  std::string name;        // as in the trace, for cuprofSetFilter()
+  uint64_t launches;       // launches so far, for launch sampling
+  uint64_t launches_skipped;
+  uint64_t launch_last;    // host time of the last launch, for the
+                           // flight recorder trigger
+  const void* kdata_sym;
+  const void* kid_sym;
+  const byte* kdata;       // header data, written to the trace on first launch
+  size_t kdata_size;
+} kernel_info_t;
+
+static std::deque<kernel_info_t>& kernelInfos() {
+  static std::deque<kernel_info_t> infos(1); // id 0 is reserved
+  return infos;
+}
+
+static std::unordered_map<const void*, uint32_t>& kernelIds() {
+  static std::unordered_map<const void*, uint32_t> ids;
+  return ids;
+}
+
+static std::mutex& kernelsMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+static kernel_info_t& kernelInfo(uint32_t kernid) {
+  std::lock_guard<std::mutex> lock(kernelsMutex());
+  return kernelInfos()[kernid];
+}
+
+// id of the kernel of an id symbol, 0 if not set up
+static uint32_t kernelId(const void* kid_sym) {
+  std::lock_guard<std::mutex> lock(kernelsMutex());
+  auto found = kernelIds().find(kid_sym);
+  return (found != kernelIds().end()) ? found->second : 0;
+}
+
+static uint32_t kernelCount() {
+  return ___cuprof_kernel_count.load(std::memory_order_acquire);
+}
+
+/*******************************************************************************
+ * Sizes of live device allocations, to report the size on free.
+ */
+static std::unordered_map<uint64_t, uint64_t>& allocSizes() {
+  static std::unordered_map<uint64_t, uint64_t> sizes;
+  return sizes;
+}
+
+static std::mutex& allocSizesMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+/** Whether tracing is enabled from the start, from CUPROF_ENABLED (0, 1).
+ * Default: 1
+ */
+static uint32_t enabledFromEnv() {
+  const char* enabled_env = getenv("CUPROF_ENABLED");
+  if (!enabled_env)
+    return 1;
+  
+  return strtol(enabled_env, NULL, 10) != 0;
+}
+
+/*******************************************************************************
+ * Runtime control of tracing by the host API (cuprof.h), in the device table
+ * layout. Each consumer keeps a copy of it on its device.
+ */
+static uint32_t* controlTable() {
+  static uint32_t table[CONTROL_TABLE_UNIT] = {enabledFromEnv()};
+  return table;
+}
+
+static std::mutex& controlMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+static bool tracingEnabled() {
+  std::lock_guard<std::mutex> lock(controlMutex());
+  return controlTable()[CONTROL_ENABLED] != 0;
+}
+
+static bool kernelTraced(uint32_t kernid) {
+  std::lock_guard<std::mutex> lock(controlMutex());
+  const uint32_t* table = controlTable();
+  if (!table[CONTROL_ENABLED])
+    return false;
+
+  uint32_t kernel_count = table[CONTROL_KERNEL_COUNT];
+  if (kernel_count == 0)
+    return true;
+  return std::find(table + CONTROL_KERNELS, table + CONTROL_KERNELS + kernel_count,
+                   kernid) != table + CONTROL_KERNELS + kernel_count;
+}
+
+/*******************************************************************************
+ * Launch sampling of the host: which launches of each kernel are traced,
+ * counted per kernel (from 1). Unsampled launches set the launch skip word
+ * of the kernel on the device, on the launch stream.
+ */
+typedef struct launch_sampling_t {
+  uint64_t first;
+  uint64_t every;
+  uint64_t from;  // 0: from the first launch
+  uint64_t to;    // 0: to the last launch
+} launch_sampling_t;
+
+/** Launch sampling policy, from CUPROF_LAUNCH_SAMPLING
+ * ("first=N,every=N,from=N,to=N", any of them).
+ * Default: all launches
+ */
+static launch_sampling_t launchSamplingFromEnv() {
+  launch_sampling_t policy = {};
+  const char* sampling_env = getenv("CUPROF_LAUNCH_SAMPLING");
+  if (!sampling_env)
+    return policy;
+
+  const char* pos = sampling_env;
+  while (*pos != '\0') {
+    const char* value = strchr(pos, '=');
+    if (!value)
+      break;
+    char* end;
+    uint64_t num = strtoull(value + 1, &end, 10);
+    
+    size_t key_len = value - pos;
+    if (key_len == 5 && strncmp(pos, "first", 5) == 0) {
+      policy.first = num;
+    } else if (key_len == 5 && strncmp(pos, "every", 5) == 0) {
+      policy.every = num;
+    } else if (key_len == 4 && strncmp(pos, "from", 4) == 0) {
+      policy.from = num;
+    } else if (key_len == 2 && strncmp(pos, "to", 2) == 0) {
+      policy.to = num;
+    } else {
+      break;
+    }
+    
+    pos = (*end == ',') ? end + 1 : end;
+  }
+  
+  if (*pos != '\0') {
+    fprintf(stderr, "CUPROF_LAUNCH_SAMPLING: ignored from \"%s\"\n", pos);
+  }
+  return policy;
+}
+
+// guarded by controlMutex()
+static launch_sampling_t& launchSampling() {
+  static launch_sampling_t policy = launchSamplingFromEnv();
+  return policy;
+}
+
+static bool launchSamplingActive(const launch_sampling_t& policy) {
+  return policy.first || policy.every || policy.from || policy.to;
+}
+
+// whether launch number <launch> of a kernel is sampled
+static bool launchSampled(const launch_sampling_t& policy, uint64_t launch) {
+  if (launch < policy.from || (policy.to && launch > policy.to))
+    return false;
+  if (!policy.first && !policy.every)
+    return true;
+
+  uint64_t index = launch - std::max(policy.from, (uint64_t)1);
+  return index < policy.first ||
+    (policy.every && (index + 1) % policy.every == 0);
+}
+
+// count the launch of the kernel, and tell whether it is sampled.
+// Once a policy was set, the sampling record of the kernel is
+// put to <payload> (time excluded), and <recorded> is set.
+static bool launchCount(uint32_t kernid, uint64_t* payload, bool* recorded) {
+  std::lock_guard<std::mutex> lock(controlMutex());
+  static bool sampling_used = false;
+  const launch_sampling_t& policy = launchSampling();
+  sampling_used = sampling_used || launchSamplingActive(policy);
+  *recorded = sampling_used && kernid != 0;
+  if (kernid == 0)
+    return true;
+
+  kernel_info_t& info = kernelInfo(kernid);
+  bool sampled = launchSampled(policy, ++info.launches);
+  if (!sampled)
+    info.launches_skipped++;
+
+  uint64_t fields[HOSTREC_LAUNCH_SAMPLING_UNIT] = {
+    0, kernid, info.launches, info.launches_skipped,
+    policy.first, policy.every, policy.from, policy.to
+  };
+  memcpy(payload, fields, sizeof(fields));
+  return sampled;
+}
+
+static size_t flightRecorderSize();
+static uint64_t flightTriggerNs();
+
+// whether the launch of the kernel follows its last launch by more than
+// the flight recorder trigger
+static bool launchSlow(uint32_t kernid) {
+  if (kernid == 0 || !flightRecorderSize() || !flightTriggerNs())
+    return false;
+
+  uint64_t now = monotonic_ns();
+  std::lock_guard<std::mutex> lock(controlMutex());
+  kernel_info_t& info = kernelInfo(kernid);
+  bool slow = info.launch_last != 0 &&
+    now - info.launch_last > flightTriggerNs();
+  info.launch_last = now;
+  return slow;
+}
+
+/*******************************************************************************
+ * Metadata of the kernels (header data, names, table sizes), fetched from
+ * the current device on first need, for all kernels set up since the last
+ * fetch at once: the copies are queued to a stream and waited for once.
+ * The header data of each batch is kept until exit, as consumer threads
+ * write it to the traces when the kernels are first launched.
+ */
+static std::atomic<uint32_t> kernels_fetched(0); // kernel ids 1 to n fetched
+
+static void kernelsFetch() {
+  static std::mutex mutex;
+  uint32_t kernel_count = kernelCount();
+  if (kernels_fetched.load(std::memory_order_acquire) == kernel_count) {
+    return;
+  }
+  
+  std::lock_guard<std::mutex> lock(mutex);
+  uint32_t kernid_begin = kernels_fetched.load(std::memory_order_relaxed) + 1;
+  uint32_t kernid_end = kernel_count + 1;
+  if (kernid_begin >= kernid_end)
+    return;
+  
+  std::vector<kernel_info_t*> infos(kernid_end);
+  for (uint32_t kernid = kernid_begin; kernid < kernid_end; kernid++) {
+    infos[kernid] = &kernelInfo(kernid);
+  }
+
+  // symbol sizes are looked up on the host
+  std::vector<size_t> kdata_offsets;
+  size_t kdata_total = 0;
+  for (uint32_t kernid = kernid_begin; kernid < kernid_end; kernid++) {
+    kernel_info_t& info = *infos[kernid];
+    size_t kdata_size;
+    cudaChecked(cudaGetSymbolSize(&kdata_size, info.kdata_sym));
+    kdata_offsets.push_back(kdata_total);
+    kdata_total += kdata_size;
+  }
+  kdata_offsets.push_back(kdata_total);
+
+  
+  // get kernel access data from device, and append to host-side var
+  uint8_t* kdata_h;
+  cudaStream_t stream;
+  cudaChecked(cudaHostAlloc(&kdata_h, std::max(kdata_total, (size_t)1),
+                            cudaHostAllocDefault));
+  cudaChecked(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  for (uint32_t kernid = kernid_begin; kernid < kernid_end; kernid++) {
+    size_t i = kernid - kernid_begin;
+    cudaChecked(cudaMemcpyFromSymbolAsync(kdata_h + kdata_offsets[i],
+                                          infos[kernid]->kdata_sym,
+                                          kdata_offsets[i+1] - kdata_offsets[i],
+                                          0, cudaMemcpyDeviceToHost, stream));
+  }
+  cudaChecked(cudaStreamSynchronize(stream));
+  cudaChecked(cudaStreamDestroy(stream));
+  
+  byte* kdata = (byte*) malloc(kdata_total + 1);
+  if (!kdata) {
+    fprintf(stderr, "Failed to initialize memory access data!\n");
+    abort();
+  }
+  memcpy(kdata, kdata_h, kdata_total);
+  kdata[kdata_total] = '\0';
+  cudaFreeHost(kdata_h);
+  
+  // aggregation table sizes from the inst count (instid 0 unused),
+  // and kernel names, after the inst count and the name length
+  for (uint32_t kernid = kernid_begin; kernid < kernid_end; kernid++) {
+    size_t i = kernid - kernid_begin;
+    byte* kdata_buf = kdata + kdata_offsets[i];
+    infos[kernid]->kdata = kdata_buf;
+    infos[kernid]->kdata_size = kdata_offsets[i+1] - kdata_offsets[i];
+    
+    size_t kdata_offset = 0;
+    uint64_t insts_count = uint64_deserialize(kdata_buf, &kdata_offset);
+    if (infos[kernid]->aggregated) {
+      infos[kernid]->aggdat_size =
+        (insts_count + 1) * AGG_ENTRY_UNIT * sizeof(uint64_t);
+    }
+    uint64_t name_len = uint64_deserialize(kdata_buf, &kdata_offset);
+    const char* name = (const char*) kdata_buf + kdata_offset;
+    infos[kernid]->name = std::string(name, strnlen(name, name_len));
+  }
+  
+  kernels_fetched.store(kernid_end - 1, std::memory_order_release);
+}
+
+/** Backpressure policy of the device when a slot is full,
+ * from CUPROF_BACKPRESSURE (spin, sleep, yield, handoff).
+ * Default: spin
+ */
+static uint32_t backpressurePolicy() {
+  const char* policy_env = getenv("CUPROF_BACKPRESSURE");
+  if (!policy_env || strcmp(policy_env, "spin") == 0) {
+    return BACKPRESSURE_SPIN;
+  } else if (strcmp(policy_env, "sleep") == 0) {
+    return BACKPRESSURE_SLEEP;
+  } else if (strcmp(policy_env, "yield") == 0) {
+    return BACKPRESSURE_YIELD;
+  } else if (strcmp(policy_env, "handoff") == 0) {
+    return BACKPRESSURE_HANDOFF;
+  }
+
+  fprintf(stderr, "Unknown CUPROF_BACKPRESSURE '%s', using 'spin'\n", policy_env);
+  return BACKPRESSURE_SPIN;
+}
+
+/** Pinned record memory of the slots of each device in MB,
+ * from CUPROF_SLOT_MEMORY. Slots are SLOT_SIZE each, so this caps the slot
+ * count below the SM count on large devices; several SMs then share a slot.
+ * Default: 32 (16 slots)
+ */
+static int slotCountMax() {
+  const char* memory_env = getenv("CUPROF_SLOT_MEMORY");
+  uint64_t memory = (memory_env ? strtoull(memory_env, NULL, 0) : 32) << 20;
+  return (int) std::min(std::max(memory / SLOT_SIZE, (uint64_t)1),
+                        (uint64_t)SLOTS_PER_DEV_MAX);
+}
+
+/** Maximum sampling divisor of adaptive sampling,
+ * from CUPROF_ADAPTIVE_SAMPLING.
+ * Default: 1 (adaptive sampling disabled)
+ */
+static uint32_t samplingMax() {
+  const char* sampling_env = getenv("CUPROF_ADAPTIVE_SAMPLING");
+  if (!sampling_env)
+    return 1;
+  
+  long sampling_max = strtol(sampling_env, NULL, 10);
+  return (uint32_t) std::min(std::max(sampling_max, 1L), (long)UINT32_MAX);
+}
+
+static_assert(CUPROF_ADDR_RANGE_MAX == ADDR_RANGE_MAX,
+              "address range limits of the API and the device differ");
+static_assert(CUPROF_KERNEL_FILTER_MAX == KERNEL_FILTER_MAX,
+              "kernel filter limits of the API and the device differ");
+static_assert(CUPROF_MARKER_NAME_MAX == HOSTREC_MARKER_NAME_MAX,
+              "marker name limits of the API and the trace differ");
+
+/** Address ranges to be traced, from CUPROF_ADDR_RANGES
+ * ("lo-hi,lo-hi,...", hi exclusive), into the device table layout.
+ * Default: all addresses
+ */
+static void addrRangesFromEnv(uint64_t* table) {
+  memset(table, 0, ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t));
+  
+  const char* ranges_env = getenv("CUPROF_ADDR_RANGES");
+  if (!ranges_env)
+    return;
+
+  const char* pos = ranges_env;
+  uint64_t count = 0;
+  while (*pos != '\0') {
+    char* end;
+    uint64_t lo = strtoull(pos, &end, 0);
+    if (*end != '-') break;
+    uint64_t hi = strtoull(end + 1, &end, 0);
+    if (hi <= lo || (*end != ',' && *end != '\0')) break;
+
+    if (count == ADDR_RANGE_MAX) {
+      fprintf(stderr, "CUPROF_ADDR_RANGES: more than %d ranges, ignoring the rest\n",
+              ADDR_RANGE_MAX);
+      break;
+    }
+    table[1 + 2*count] = lo;
+    table[2 + 2*count] = hi - lo;
+    count++;
+    
+    pos = (*end == ',') ? end + 1 : end;
+  }
+
+  if (*pos != '\0' && count < ADDR_RANGE_MAX) {
+    fprintf(stderr, "CUPROF_ADDR_RANGES: malformed range at '%s'\n", pos);
+  }
+  table[0] = count;
+}
+
+// period of adaptive sampling decisions
+#define SAMPLING_PERIOD_NS (10 * 1000 * 1000)
 //********************
 static const char* getexename() {
   static char* cmdline = NULL;
@@ -113,6 +532,115 @@ static std::string traceName(int device) {
   return pattern;
 }
 
+/** Trace files are written unless CUPROF_WRITE_FILE=0, e.g. when
+ * the traces are only analyzed by plugins.
+ */
+//*************************************
+static bool traceFileEnabled() {
+  static const bool enabled = []() {
+    const char* write_env = getenv("CUPROF_WRITE_FILE");
+    return !(write_env && strcmp(write_env, "0") == 0);
+  }();
+  return enabled;
+}
+
+/** Analysis plugins of CUPROF_PLUGINS ("lib1.so:lib2.so"),
+ * loaded on the first use. Plugins failing to load are skipped.
+ */
+//*************************************
+static const std::vector<const cuprof_plugin_t*>& plugins() {
+  static const std::vector<const cuprof_plugin_t*> loaded = []() {
+    std::vector<const cuprof_plugin_t*> result;
+    const char* plugins_env = getenv("CUPROF_PLUGINS");
+    if (!plugins_env) {
+      return result;
+    }
+
+    std::string list = plugins_env;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+      size_t end = list.find(':', begin);
+      if (end == std::string::npos) {
+        end = list.size();
+      }
+      std::string path = list.substr(begin, end - begin);
+      begin = end + 1;
+      if (path.empty()) {
+        continue;
+      }
+
+      void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+      if (!handle) {
+        fprintf(stderr, "cuprof: unable to load plugin '%s': %s\n",
+                path.c_str(), dlerror());
+        continue;
+      }
+      cuprof_plugin_func_t get_plugin =
+        (cuprof_plugin_func_t) dlsym(handle, CUPROF_PLUGIN_SYMBOL);
+      const cuprof_plugin_t* plugin = get_plugin ? get_plugin() : NULL;
+      if (!plugin || !plugin->open || !plugin->write || !plugin->close) {
+        fprintf(stderr, "cuprof: invalid plugin '%s'\n", path.c_str());
+        dlclose(handle);
+        continue;
+      }
+      result.push_back(plugin); // kept loaded until exit
+    }
+    return result;
+  }();
+  return loaded;
+}
+
+/** Flight recorder: with CUPROF_FLIGHT_RECORDER=(MB), the trace of each
+ * device is kept in a history of the given size instead of the trace
+ * file, and written out on request. Returns the size in bytes, 0 if off.
+ */
+//*************************************
+static size_t flightRecorderSize() {
+  static const size_t size = []() {
+    const char* size_env = getenv("CUPROF_FLIGHT_RECORDER");
+    return size_env ? (size_t) strtoull(size_env, NULL, 0) << 20 : 0;
+  }();
+  return size;
+}
+
+/** CUPROF_FLIGHT_TRIGGER=(ms): request a flight recorder dump when a
+ * kernel is launched more than the given time after its last launch,
+ * e.g. on a slow iteration. Returns the time in ns, 0 if off.
+ */
+//*************************************
+static uint64_t flightTriggerNs() {
+  static const uint64_t trigger = []() {
+    const char* trigger_env = getenv("CUPROF_FLIGHT_TRIGGER");
+    return trigger_env ? strtoull(trigger_env, NULL, 0) * 1000000 : 0;
+  }();
+  return trigger;
+}
+
+/** Trace file rotation: CUPROF_ROTATE_SIZE=(MB) and / or
+ * CUPROF_ROTATE_LAUNCHES=(n) continue the trace of each device in a new
+ * file after the given size or number of launches. 0 if off.
+ */
+//*************************************
+static uint64_t rotateBytes() {
+  static const uint64_t size = []() {
+    const char* size_env = getenv("CUPROF_ROTATE_SIZE");
+    return size_env ? strtoull(size_env, NULL, 0) << 20 : 0;
+  }();
+  return size;
+}
+
+static uint64_t rotateLaunches() {
+  static const uint64_t launches = []() {
+    const char* launches_env = getenv("CUPROF_ROTATE_LAUNCHES");
+    return launches_env ? strtoull(launches_env, NULL, 0) : 0;
+  }();
+  return launches;
+}
+
+// dump requests to the flight recorders of all devices; incremented
+// from signal handlers, so lock-free
+static std::atomic<uint64_t> recorder_requests(0);
+
 /*******************************************************************************
  * TraceConsumer sets up and consumes a queue that can be used by kernels to
  * to write their traces into.
@@ -149,24 +677,23 @@ static std::string traceName(int device) {
  */
 
 
-typedef struct kernel_trace_arg_t {
-  const char* kernel_name;
-  uint64_t kernel_grid_dim;
-  uint16_t kernel_cta_size;
-  int device;
-} kernel_trace_arg_t;
-
 //////////
 //static uint8_t buf_tmp[RECORDS_PER_SLOT * RECORD_MAX_SIZE];
 
 class TraceConsumer {
 public:
 
+  // launch data of a traced launch, see launchData()
+  typedef struct launch_data_t {
+    uint64_t* ptr;  // device memory, LAUNCH_DATA_UNIT or more
+    size_t size;
+  } launch_data_t;
+
   TraceConsumer() {
   }
 
   //*********************************
-  TraceConsumer(int device) {
+  TraceConsumer(int device, const uint64_t* addr_ranges) {
 
     int debug_count = 0;
     //printf("%lf - TraceConsumer[%d] (%d)\n", rtclock(), device, debug_count++); //////////////////////////////////////
@@ -184,85 +711,154 @@ public:
                                              cudaStreamNonBlocking,
                                              range[1]));
 
+
+    // one slot per SM, as device threads select slots by their SM,
+    // within the record memory budget of the device
+    int sm_count;
+    cudaChecked(cudaDeviceGetAttribute(&sm_count,
+                                       cudaDevAttrMultiProcessorCount,
+                                       device));
+    slot_count = std::min(std::max(sm_count, 1), slotCountMax());
+    traceinfo.info_d.slot_count = slot_count;
+    traceinfo.info_d.backpressure = backpressurePolicy();
+
+    // sampling divisor, read by every memory trace call of the device;
+    // kept in device memory, and updated asynchronously as it rarely changes
+    sampling_max = samplingMax();
+    sampling_div = 1;
+    sampling_time = monotonic_ns();
+    sampling_occupancy = 0;
+    sampling_stalled = false;
+    cudaChecked(cudaHostAlloc(&sampling_h, sizeof(uint32_t),
+                              cudaHostAllocPortable));
+    *sampling_h = sampling_div;
+    cudaChecked(cudaMalloc(&traceinfo.info_d.sampling_d, sizeof(uint32_t)));
+    cudaChecked(cudaMemcpyAsync(traceinfo.info_d.sampling_d, sampling_h,
+                                sizeof(uint32_t), cudaMemcpyHostToDevice,
+                                cudastream_trace));
+
+    // address ranges to be traced
+    cudaChecked(cudaHostAlloc(&addr_ranges_h,
+                              ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t),
+                              cudaHostAllocPortable));
+    memcpy(addr_ranges_h, addr_ranges, ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t));
+    cudaChecked(cudaMalloc(&traceinfo.info_d.addr_ranges_d,
+                           ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t)));
+    cudaChecked(cudaMemcpyAsync(traceinfo.info_d.addr_ranges_d, addr_ranges_h,
+                                ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t),
+                                cudaMemcpyHostToDevice, cudastream_trace));
+
+    // runtime control (enabled, kernel filter), read at kernel entry
+    cudaChecked(cudaHostAlloc(&control_h,
+                              CONTROL_TABLE_UNIT * sizeof(uint32_t),
+                              cudaHostAllocPortable));
+    {
+      std::lock_guard<std::mutex> lock(controlMutex());
+      memcpy(control_h, controlTable(), CONTROL_TABLE_UNIT * sizeof(uint32_t));
+    }
+    cudaChecked(cudaMalloc(&traceinfo.info_d.control_d,
+                           CONTROL_TABLE_UNIT * sizeof(uint32_t)));
+    cudaChecked(cudaMemcpyAsync(traceinfo.info_d.control_d, control_h,
+                                CONTROL_TABLE_UNIT * sizeof(uint32_t),
+                                cudaMemcpyHostToDevice, cudastream_trace));
+
     
     // allocate and initialize traceinfo of the host
     cudaChecked(cudaMalloc(&traceinfo.info_d.allocs_d,
-                           SLOTS_PER_DEV * CACHELINE));
+                           slot_count * CACHELINE));
     cudaChecked(cudaMemsetAsync(traceinfo.info_d.allocs_d, 0,
-                                SLOTS_PER_DEV * CACHELINE,
+                                slot_count * CACHELINE,
                                 cudastream_trace));
     
     cudaChecked(cudaMalloc(&traceinfo.info_d.commits_d,
-                           SLOTS_PER_DEV * CACHELINE));
+                           slot_count * CACHELINE));
     cudaChecked(cudaMemsetAsync(traceinfo.info_d.commits_d, 0,
-                                SLOTS_PER_DEV * CACHELINE,
+                                slot_count * CACHELINE,
                                 cudastream_trace));
     /*
     cudaChecked(cudaMallocManaged(&traceinfo.flusheds_h,
-                                  SLOTS_PER_DEV * CACHELINE));
+                                  slot_count * CACHELINE));
     traceinfo.info_d.flusheds_d = traceinfo.flusheds_h;
     cudaChecked(cudaMemsetAsync(traceinfo.info_d.flusheds_d, 0,
-                                SLOTS_PER_DEV * CACHELINE,
+                                slot_count * CACHELINE,
                                 cudastream_trace));
     */
-    /*
-    cudaChecked(cudaHostAlloc(&traceinfo.flusheds_h,
-                              SLOTS_PER_DEV * CACHELINE,
-                              cudaHostAllocMapped));
-    cudaChecked(cudaHostGetDevicePointer(&traceinfo.info_d.flusheds_d,
-                                         traceinfo.flusheds_h, 0));
-    memset(traceinfo.flusheds_h, 0,
-           SLOTS_PER_DEV * CACHELINE);
-    */
-    
+
+    // flush acks are plain host stores into mapped memory if possible,
+    // otherwise copies into device memory on the trace stream
+    int can_map_host = 0;
+#ifndef CUPROF_MAPPED_ACK_DISABLE
+    cudaChecked(cudaDeviceGetAttribute(&can_map_host,
+                                       cudaDevAttrCanMapHostMemory,
+                                       device));
+#endif
+    traceinfo.flusheds_mapped = can_map_host;
+
+    if (traceinfo.flusheds_mapped) {
+      cudaChecked(cudaHostAlloc(&traceinfo.flusheds_h,
+                                slot_count * CACHELINE,
+                                cudaHostAllocMapped));
+      cudaChecked(cudaHostGetDevicePointer(&traceinfo.info_d.flusheds_d,
+                                           traceinfo.flusheds_h, 0));
+      memset(traceinfo.flusheds_h, 0,
+             slot_count * CACHELINE);
       
-    cudaChecked(cudaMalloc(&traceinfo.info_d.flusheds_d,
-                           SLOTS_PER_DEV * CACHELINE));
-    cudaChecked(cudaMemsetAsync(traceinfo.info_d.flusheds_d, 0,
-                                SLOTS_PER_DEV * CACHELINE,
+    } else {
+      cudaChecked(cudaMalloc(&traceinfo.info_d.flusheds_d,
+                             slot_count * CACHELINE));
+      cudaChecked(cudaMemsetAsync(traceinfo.info_d.flusheds_d, 0,
+                                  slot_count * CACHELINE,
+                                  cudastream_trace));
+      traceinfo.flusheds_h = traceinfo.info_d.flusheds_d;
+    }
+
+    // warps check the fill of a slot against the last flushed counter
+    // they have seen, and read flusheds_d only when that looks full
+    cudaChecked(cudaMalloc(&traceinfo.info_d.flusheds_seen_d,
+                           slot_count * CACHELINE));
+    cudaChecked(cudaMemsetAsync(traceinfo.info_d.flusheds_seen_d, 0,
+                                slot_count * CACHELINE,
                                 cudastream_trace));
-    traceinfo.flusheds_h = traceinfo.info_d.flusheds_d;
-    //printf("%p\n", traceinfo.info_d.flusheds_d);
 
 
 
     
 
     traceinfo.flusheds_old =
-      (uint8_t*) malloc(SLOTS_PER_DEV * CACHELINE);
+      (uint8_t*) malloc(slot_count * CACHELINE);
     always_assert(traceinfo.flusheds_old);
-    memset(traceinfo.flusheds_old, 0, SLOTS_PER_DEV * CACHELINE);
+    memset(traceinfo.flusheds_old, 0, slot_count * CACHELINE);
 
     cudaChecked(cudaHostAlloc(&traceinfo.signals_h,
-                              SLOTS_PER_DEV * CACHELINE,
+                              slot_count * CACHELINE,
                               cudaHostAllocMapped));
     cudaChecked(cudaHostGetDevicePointer(&traceinfo.info_d.signals_d,
                                          traceinfo.signals_h, 0));
     memset(traceinfo.signals_h, 0,
-           SLOTS_PER_DEV * CACHELINE);
+           slot_count * CACHELINE);
 
 
 #ifndef CUPROF_RECBUF_MANAGED
 
     cudaChecked(cudaHostAlloc(&traceinfo.records_h,
-                              SLOTS_PER_DEV
+                              slot_count
                               * SLOT_SIZE,
                               cudaHostAllocMapped));
     cudaChecked(cudaHostGetDevicePointer(&traceinfo.info_d.records_d,
                                          traceinfo.records_h,
                                          0));
     memset(traceinfo.records_h, 0,
-           SLOTS_PER_DEV * SLOT_SIZE);
+           slot_count * SLOT_SIZE);
 
     
 #else
 
     cudaChecked(cudaMallocManaged(&traceinfo.records_h,
-                                  SLOTS_PER_DEV
+                                  slot_count
                                   * SLOT_SIZE));
     traceinfo.info_d.records_d = traceinfo.records_h;
     cudaChecked(cudaMemsetAsync(traceinfo.info_d.records_d, 0,
-                                SLOTS_PER_DEV * SLOT_SIZE,
+                                slot_count * SLOT_SIZE,
                                 cudastream_trace));
     
 #endif
@@ -282,13 +878,53 @@ public:
     
     should_run = true;
     does_run = false;
+    flush_requested = 0;
+    flush_done = 0;
     //to_be_terminated = false;
 
     pipe_name = traceName(device);
-    tracefile = trace_write_open(this->pipe_name.c_str());
+    for (const cuprof_plugin_t* plugin : plugins()) {
+      void* state = plugin->open(device, pipe_name.c_str());
+      if (state) {
+        plugin_states.push_back({plugin, state});
+      }
+    }
+    recorder_size = flightRecorderSize();
+    recorder_head = 0;
+    recorder_aligned = true;
+    recorder_header_done = false;
+    recorder_dumps = 0;
+    state_kept = 0;
+    recorder_done = recorder_requests.load();
+    if (recorder_size) {
+      recorder_ring.resize(recorder_size);
+    }
+    
+    // rotation applies to trace files only
+    bool file_written = traceFileEnabled() && !recorder_size;
+    rotate_bytes = rotateBytes();
+    rotate_launches = rotateLaunches();
+    if (!file_written ||
+        pipe_name.compare(0, sizeof(TRACEFILE_UNIX_PREFIX) - 1,
+                          TRACEFILE_UNIX_PREFIX) == 0 ||
+        pipe_name.compare(0, sizeof(TRACEFILE_SHM_PREFIX) - 1,
+                          TRACEFILE_SHM_PREFIX) == 0) {
+      rotate_bytes = 0;
+      rotate_launches = 0;
+    }
+    launches_numbered = 0;
+    launch_boundary = rotate_launches;
+    launch_boundary_done = 0;
+    segment_seq = 0;
+    std::string file_name = (rotate_bytes || rotate_launches)
+      ? segmentName(0) : pipe_name;
+    
+    tracefile = trace_write_open_sink(
+      file_written ? file_name.c_str() : NULL,
+      (plugin_states.empty() && !recorder_size) ? NULL : traceSink, this);
     if (tracefile == NULL) {
       fprintf(stderr, "unable to open trace file '%s' for writing\n",
-              pipe_name.c_str());
+              file_name.c_str());
       abort();
     }
 
@@ -296,11 +932,21 @@ public:
     this->device = device;
     
     
-    trace_write_header(tracefile, ___cuprof_accdat_var, ___cuprof_accdat_varlen);
+    // kernels are written as HOSTREC_KERNEL on their first launch
+    trace_write_header(tracefile, "", 0);
     header_written = false;
+    if (recorder_size) {
+      tracefile_flush(tracefile); // not recorded, dumps start with their own
+      recorder_header_done = true;
+    }
 
     
-    cudaDeviceSynchronize();
+    // ids of the kernels set up so far
+    setKernelIds(1, kernelCount() + 1);
+
+    // created on the first use of the device, possibly with kernels
+    // of the application running, so wait only for the set up above
+    cudaChecked(cudaStreamSynchronize(cudastream_trace));
     worker_thread = std::thread(consume, this);
 
     //mtx_refresh_consume.unlock();
@@ -318,14 +964,42 @@ public:
     worker_thread.join();
 
     trace_write_close(tracefile);
+    for (const plugin_state_t& plugin_state : plugin_states) {
+      plugin_state.plugin->close(plugin_state.state);
+    }
+
+    for (table_fetch_t& fetch : table_free) {
+      cudaEventDestroy(fetch.done);
+      cudaFreeHost(fetch.buf);
+    }
+    for (const launch_data_t& data : launch_data_free) {
+      cudaFree(data.ptr);
+    }
+    for (const launch_done_t& launch : launch_pending) {
+      cudaEventDestroy(launch.done);
+    }
+    for (cudaEvent_t done : launch_done_free) {
+      cudaEventDestroy(done);
+    }
     
     cudaChecked(cudaStreamDestroy(cudastream_trace));
     
     
     cudaFree(traceinfo.info_d.allocs_d);
     cudaFree(traceinfo.info_d.commits_d);
-    cudaFree(traceinfo.info_d.flusheds_d);
+    if (traceinfo.flusheds_mapped) {
+      cudaFreeHost(traceinfo.flusheds_h);
+    } else {
+      cudaFree(traceinfo.info_d.flusheds_d);
+    }
+    cudaFree(traceinfo.info_d.flusheds_seen_d);
     free(traceinfo.flusheds_old);
+    cudaFree(traceinfo.info_d.sampling_d);
+    cudaFreeHost(sampling_h);
+    cudaFree(traceinfo.info_d.addr_ranges_d);
+    cudaFreeHost(addr_ranges_h);
+    cudaFree(traceinfo.info_d.control_d);
+    cudaFreeHost(control_h);
     cudaFreeHost(traceinfo.signals_h);
 
 #ifndef CUPROF_RECBUF_MANAGED
@@ -337,6 +1011,226 @@ public:
 #endif
   }
 
+  // replace the address range table of the device, without waiting for
+  // running kernels (they see the new ranges in a short while)
+  void setAddrRanges(const uint64_t* table) {
+    std::lock_guard<std::mutex> lock(addr_ranges_mutex);
+    
+    memcpy(addr_ranges_h, table, ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t));
+    cudaChecked(cudaMemcpyAsync(traceinfo.info_d.addr_ranges_d, addr_ranges_h,
+                                ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t),
+                                cudaMemcpyHostToDevice, cudastream_trace));
+    cudaChecked(cudaStreamSynchronize(cudastream_trace));
+  }
+
+  // set the ids of kernels [kernid_begin, kernid_end) on the device,
+  // waiting for the copies once
+  void setKernelIds(uint32_t kernid_begin, uint32_t kernid_end) {
+    if (kernid_begin >= kernid_end)
+      return;
+    
+    int device_initial;
+    cudaChecked(cudaGetDevice(&device_initial));
+    cudaChecked(cudaSetDevice(device));
+
+    std::vector<uint32_t> kernids;
+    for (uint32_t kernid = kernid_begin; kernid < kernid_end; kernid++) {
+      kernids.push_back(kernid);
+    }
+    for (uint32_t kernid = kernid_begin; kernid < kernid_end; kernid++) {
+      cudaChecked(cudaMemcpyToSymbolAsync(kernelInfo(kernid).kid_sym,
+                                          &kernids[kernid - kernid_begin],
+                                          sizeof(uint32_t), 0,
+                                          cudaMemcpyHostToDevice,
+                                          cudastream_trace));
+    }
+    cudaChecked(cudaStreamSynchronize(cudastream_trace));
+    
+    cudaChecked(cudaSetDevice(device_initial));
+  }
+
+  // replace the control table of the device; kernels read it when their
+  // threads start, so running kernels are not affected
+  void setControl(const uint32_t* table) {
+    std::lock_guard<std::mutex> lock(control_mutex);
+    
+    memcpy(control_h, table, CONTROL_TABLE_UNIT * sizeof(uint32_t));
+    cudaChecked(cudaMemcpyAsync(traceinfo.info_d.control_d, control_h,
+                                CONTROL_TABLE_UNIT * sizeof(uint32_t),
+                                cudaMemcpyHostToDevice, cudastream_trace));
+    cudaChecked(cudaStreamSynchronize(cudastream_trace));
+  }
+
+  // write out all records, events and tables so far to the trace file,
+  // waiting for the consumer thread. No kernel may be running on the device.
+  void flush() {
+    std::unique_lock<std::mutex> lock(flush_mutex);
+    uint64_t request = ++flush_requested;
+    flush_cv.wait(lock, [this, request]() {
+        return flush_done >= request || !should_run;
+      });
+  }
+
+  // wait until the flight recorder has handled the dump request
+  void waitDump(uint64_t request) {
+    std::unique_lock<std::mutex> lock(flush_mutex);
+    flush_cv.wait(lock, [this, request]() {
+        return recorder_done >= request || !should_run;
+      });
+  }
+
+  // whether the flight recorder has handled the dump request;
+  // async-signal-safe
+  bool dumped(uint64_t request) {
+    return recorder_done.load() >= request || !does_run.load();
+  }
+
+  // queue the header data of a kernel before its first traced launch
+  // on the device, from an application thread
+  void pushKernel(uint32_t kernid, const byte* kdata, size_t kdata_size) {
+    {
+      std::lock_guard<std::mutex> lock(event_mutex);
+      if (kernid < kernels_written.size() && kernels_written[kernid])
+        return;
+      if (kernid >= kernels_written.size())
+        kernels_written.resize(kernid + 1, false);
+      kernels_written[kernid] = true;
+    }
+    
+    uint64_t payload[3] = {kernid, (uint64_t) kdata, kdata_size};
+    pushEvent(HOSTREC_KERNEL, payload, 3);
+  }
+
+  // with rotation by launches, number a traced launch on the device,
+  // from the application thread right before its launch record is queued.
+  // Returns the number to pass to launchEnd() after the launch,
+  // or UINT64_MAX if launches are not counted.
+  uint64_t launchBegin() {
+    if (!rotate_launches)
+      return UINT64_MAX;
+    return launches_numbered++;
+  }
+
+  // mark the end of the numbered launch on its stream, after the launch
+  // and its table fetches. The consumer thread ends the segment once all
+  // launches before the boundary have ended (see launchSegmentDone()),
+  // so the application never waits for the device.
+  void launchEnd(uint64_t launch, cudaStream_t stream) {
+    launch_done_t launch_done = {launch, NULL};
+    {
+      std::lock_guard<std::mutex> lock(launch_mutex);
+      if (!launch_done_free.empty()) {
+        launch_done.done = launch_done_free.back();
+        launch_done_free.pop_back();
+      }
+    }
+    if (!launch_done.done) {
+      cudaChecked(cudaEventCreateWithFlags(&launch_done.done,
+                                           cudaEventDisableTiming));
+    }
+    cudaChecked(cudaEventRecord(launch_done.done, stream));
+
+    std::lock_guard<std::mutex> lock(launch_mutex);
+    launch_pending.push_back(launch_done);
+  }
+
+  // queue a host record from an application thread,
+  // written by the consumer thread
+  void pushEvent(uint32_t type, const uint64_t* payload, uint32_t unit) {
+    host_event_t event = {};
+    event.type = type;
+    event.unit = std::min(unit, (uint32_t)HOSTREC_EVENT_UNIT_MAX);
+    memcpy(event.payload, payload, event.unit * sizeof(uint64_t));
+    
+    std::lock_guard<std::mutex> lock(event_mutex);
+    event_pending.push_back(event);
+  }
+
+  // launch data (LAUNCH_DATA_*) for a traced launch of a kernel on the
+  // launch stream, from an application thread, with an aggregation table
+  // of aggdat_size bytes. Launch data is reused once fetchLaunch() has
+  // copied out and reset the tables of its last launch.
+  launch_data_t launchData(size_t aggdat_size, cudaStream_t stream) {
+    size_t size = LAUNCH_DATA_UNIT * sizeof(uint64_t) + aggdat_size;
+    launch_data_t data = {};
+    
+    {
+      std::lock_guard<std::mutex> lock(table_mutex);
+      auto found = std::find_if(launch_data_free.begin(), launch_data_free.end(),
+                                [size](const launch_data_t& d) {
+                                  return d.size >= size;
+                                });
+      if (found != launch_data_free.end()) {
+        data = *found;
+        launch_data_free.erase(found);
+      }
+    }
+
+    if (!data.ptr) {
+      cudaChecked(cudaMalloc(&data.ptr, size));
+      cudaChecked(cudaMemsetAsync(data.ptr, 0, size, stream));
+      data.size = size;
+    }
+    return data;
+  }
+
+  // copy out the tables of the launch data of a launch (HOSTREC_KERNEL_STAT,
+  // and HOSTREC_AGGREGATE if aggdat_size) after the launch, and reset them
+  // for the next launch, in order on the launch stream. The consumer thread
+  // writes the tables when the copies are done, and then frees the launch
+  // data for reuse with the last table.
+  void fetchLaunch(uint32_t kernid, launch_data_t data, size_t aggdat_size,
+                   cudaStream_t stream) {
+    fetchTable(HOSTREC_KERNEL_STAT, kernid, data.ptr + LAUNCH_DATA_KSTAT,
+               KSTAT_UNIT * sizeof(uint64_t), stream,
+               aggdat_size ? launch_data_t() : data);
+    if (aggdat_size) {
+      fetchTable(HOSTREC_AGGREGATE, kernid, data.ptr + LAUNCH_DATA_AGG,
+                 aggdat_size, stream, data);
+    }
+  }
+
+  // copy out and reset a table of launch data, and queue it for the
+  // consumer thread; the launch data is freed with the table if release.ptr
+  void fetchTable(uint32_t type, uint32_t kernid, uint64_t* table_d,
+                  size_t table_size, cudaStream_t stream, launch_data_t release) {
+    
+    size_t buf_size = HOSTREC_TABLE_PREFIX_SIZE + table_size;
+    table_fetch_t fetch = {};
+    
+    {
+      std::lock_guard<std::mutex> lock(table_mutex);
+      auto found = std::find_if(table_free.begin(), table_free.end(),
+                                [buf_size](const table_fetch_t& f) {
+                                  return f.buf_size >= buf_size;
+                                });
+      if (found != table_free.end()) {
+        fetch = *found;
+        table_free.erase(found);
+      }
+    }
+
+    // pinned buffers and events are reused across launches
+    if (!fetch.buf) {
+      cudaChecked(cudaHostAlloc(&fetch.buf, buf_size, cudaHostAllocPortable));
+      cudaChecked(cudaEventCreateWithFlags(&fetch.done, cudaEventDisableTiming));
+      fetch.buf_size = buf_size;
+    }
+    fetch.type = type;
+    fetch.kernid = kernid;
+    fetch.table_size = table_size;
+    fetch.release = release;
+
+    cudaChecked(cudaMemcpyAsync(fetch.buf + HOSTREC_TABLE_PREFIX_SIZE, table_d,
+                                table_size, cudaMemcpyDeviceToHost, stream));
+    cudaChecked(cudaMemsetAsync(table_d, 0, table_size, stream));
+    cudaChecked(cudaEventRecord(fetch.done, stream));
+
+    std::lock_guard<std::mutex> lock(table_mutex);
+    table_pending.push_back(fetch);
+  }
+
+  
   /*
   void start(cudaStream_t stream_target, const char* name,
              uint64_t grid_dim, uint16_t cta_size) {
@@ -384,6 +1278,18 @@ public:
   
   
 protected:
+  typedef struct host_event_t {
+    uint32_t type;         // HOSTREC_*
+    uint32_t unit;
+    uint64_t payload[HOSTREC_EVENT_UNIT_MAX];
+  } host_event_t;
+
+  // host record setting the state of trace readers, at a trace position
+  typedef struct state_record_t {
+    uint64_t pos;          // recorded bytes before the record, 0 if unused
+    host_event_t event;
+  } state_record_t;
+  
 /*
   bool addStream(cudaStream_t stream_target) {
   bool return_value = false;
@@ -410,12 +1316,16 @@ protected:
   }
 */
   // clear up a slot if it is full
-  static void consumeSlot(uint8_t* alloc_d, uint8_t* commit_d,
+  // returns the flushed size, which is the occupancy of the slot at the flush
+  // events: consumer whose host records to write before the flushed ones
+  static uint32_t consumeSlot(uint8_t* alloc_d, uint8_t* commit_d,
                          uint8_t* signal_h,
                          uint8_t* flushed_h, uint8_t* flushed_old,
                          uint8_t* records_d, uint8_t* records_h,
                          tracefile_t out, bool is_kernel_active,
-                         cudaStream_t cudastream_trace) {
+                         bool flushed_mapped,
+                         cudaStream_t cudastream_trace,
+                         TraceConsumer* events) {
     
     volatile uint32_t* signal_v = (uint32_t*)signal_h;
     volatile uint32_t* flushed_v = (uint32_t*)flushed_h;
@@ -438,11 +1348,30 @@ protected:
 
     // check if to be flushed
     if ( (uint32_t)(signal - signal_old - 1) >= SLOT_SIZE ) {
-      return;
+      return 0;
     }
 
     // change old flushed value on host
     *flushed_old_v = signal;
+
+    // the launch records of the flushed records were queued before their
+    // launches, so they are queued by now; write them first
+    std::atomic_thread_fence(std::memory_order_acquire);
+    events->consumeEvents();
+
+
+    // pair the device time of the flush request with the host time
+    if (is_kernel_active) {
+      uint64_t gpu_time =
+        *(volatile uint64_t*)(signal_h + SIGNAL_TIME_OFFSET);
+      if (gpu_time != 0) {
+        uint64_t calib[2] = {gpu_time, monotonic_ns()};
+        events->keepState(HOSTREC_CLOCK_CALIB, 0, calib, 2);
+        if (trace_write_clock_calib(out, calib[0], calib[1]) != 0) {
+          fprintf(stderr, "Trace Write Error!\n");
+        }
+      }
+    }
     
 
     
@@ -518,22 +1447,232 @@ protected:
     
     // guarantee all work before flush signal to device
     std::atomic_thread_fence(std::memory_order_release);
-    cudaChecked(cudaStreamSynchronize(cudastream_trace));
 
     // flush signal to device
-    cudaChecked(cudaMemcpyAsync(flushed_d,
-                                &signal,
-                                sizeof(uint32_t), cudaMemcpyHostToDevice,
-                                cudastream_trace));
+    if (flushed_mapped) {
+      // the device polls the mapped word, so the ack is a single store
+      *flushed_v = signal;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      
+    } else {
+      cudaChecked(cudaStreamSynchronize(cudastream_trace));
+      cudaChecked(cudaMemcpyAsync(flushed_d,
+                                  &signal,
+                                  sizeof(uint32_t), cudaMemcpyHostToDevice,
+                                  cudastream_trace));
+    }
     
     
-    return;
+    return signal - signal_old;
   }
 
-  // payload function of queue consumer
-  static void consume(TraceConsumer* obj) {
-
-    cudaSetDevice(obj->device);
+  // write the fetched tables, waiting for pending fetches if wait
+  void consumeTables(bool wait) {
+    std::vector<table_fetch_t> done;
+    
+    {
+      std::lock_guard<std::mutex> lock(table_mutex);
+      for (auto iter = table_pending.begin();
+           iter != table_pending.end(); ) {
+        cudaError_t status = wait ?
+          cudaEventSynchronize(iter->done) : cudaEventQuery(iter->done);
+        if (status == cudaErrorNotReady) {
+          ++iter;
+          continue;
+        }
+        cudaChecked(status);
+        done.push_back(*iter);
+        iter = table_pending.erase(iter);
+      }
+    }
+
+    for (table_fetch_t& fetch : done) {
+      uint64_t* prefix = (uint64_t*) fetch.buf;
+      uint64_t* table = (uint64_t*) (fetch.buf + HOSTREC_TABLE_PREFIX_SIZE);
+      uint64_t entry_count = fetch.table_size / sizeof(uint64_t);
+
+      if (fetch.type == HOSTREC_AGGREGATE) {
+        entry_count = fetch.table_size / (AGG_ENTRY_UNIT * sizeof(uint64_t)) - 1;
+
+        // entry 0 (unused by the device) holds the kernel totals
+        for (int field = 0; field < AGG_ENTRY_UNIT; field++) {
+          uint64_t total = 0;
+          for (uint64_t inst = 1; inst <= entry_count; inst++) {
+            total += table[inst * AGG_ENTRY_UNIT + field];
+          }
+          table[field] = total;
+        }
+      }
+      
+      if (fetch.type == HOSTREC_KERNEL_STAT &&
+          table[KSTAT_STALL_COUNT] != 0) {
+        sampling_stalled = true;
+      }
+      
+      prefix[0] = fetch.kernid;
+      prefix[1] = entry_count;
+      if (trace_write_hostrec(tracefile, fetch.type, fetch.buf,
+                              HOSTREC_TABLE_PREFIX_SIZE + fetch.table_size) != 0) {
+        fprintf(stderr, "Trace Write Error!\n");
+      }
+    }
+
+    if (!done.empty()) {
+      std::lock_guard<std::mutex> lock(table_mutex);
+      for (table_fetch_t& fetch : done) {
+        if (fetch.release.ptr) {
+          launch_data_free.push_back(fetch.release);
+          fetch.release = launch_data_t();
+        }
+      }
+      table_free.insert(table_free.end(), done.begin(), done.end());
+    }
+  }
+
+  // write the queued host records
+  void consumeEvents() {
+    std::vector<host_event_t> events;
+    {
+      std::lock_guard<std::mutex> lock(event_mutex);
+      if (event_pending.empty())
+        return;
+      events.swap(event_pending);
+    }
+
+    for (const host_event_t& event : events) {
+      int err;
+      if (event.type == HOSTREC_KERNEL) {
+        // {kernel id, header data, size} of pushKernel()
+        err = trace_write_kernel(tracefile, event.payload[0],
+                                 (const byte*) event.payload[1],
+                                 event.payload[2]);
+        if (recorder_size || rotate_bytes || rotate_launches) {
+          written_kernels.push_back({event.payload[0], event.payload[1],
+                                     event.payload[2]});
+        }
+      } else {
+        if (event.type == HOSTREC_ALLOC || event.type == HOSTREC_LAUNCH ||
+            event.type == HOSTREC_LAUNCH_SAMPLING) {
+          // by allocation base, or by kernel id
+          keepState(event.type, event.payload[1], event.payload, event.unit);
+        }
+        err = trace_write_hostrec(tracefile, event.type, event.payload,
+                                  event.unit * sizeof(uint64_t));
+      }
+      if (err != 0) {
+        fprintf(stderr, "Trace Write Error!\n");
+      }
+    }
+  }
+
+  // adjust the sampling divisor of the device to the load of the consumer:
+  // double it while slots are flushed more than half full or warps stall,
+  // and halve it while the consumer keeps up with a single flush unit
+  void adaptSampling(uint32_t occupancy) {
+    sampling_occupancy = std::max(sampling_occupancy, occupancy);
+    
+    uint64_t now = monotonic_ns();
+    if (now - sampling_time < SAMPLING_PERIOD_NS)
+      return;
+
+    uint32_t divisor = sampling_div;
+    if (sampling_stalled || sampling_occupancy >= SLOT_SIZE / 2) {
+      divisor = std::min(divisor * 2, sampling_max);
+    } else if (sampling_occupancy <= UNIT_SLOT_SIZE) {
+      divisor = std::max(divisor / 2, (uint32_t)1);
+    }
+    
+    sampling_time = now;
+    sampling_occupancy = 0;
+    sampling_stalled = false;
+    if (divisor == sampling_div)
+      return;
+
+    sampling_div = divisor;
+    *sampling_h = divisor;
+    cudaChecked(cudaMemcpyAsync(traceinfo.info_d.sampling_d, sampling_h,
+                                sizeof(uint32_t), cudaMemcpyHostToDevice,
+                                cudastream_trace));
+    uint64_t state[2] = {now, divisor};
+    keepState(HOSTREC_SAMPLING, 0, state, 2);
+    if (trace_write_sampling(tracefile, now, divisor) != 0) {
+      fprintf(stderr, "Trace Write Error!\n");
+    }
+  }
+  
+  // with rotation by launches, whether the segment can end: the launch
+  // starting the next segment is numbered, and all launches before it
+  // have ended on the device
+  bool launchSegmentDone() {
+    if (!rotate_launches)
+      return false;
+    
+    std::vector<cudaEvent_t> done;
+    {
+      std::lock_guard<std::mutex> lock(launch_mutex);
+      for (auto iter = launch_pending.begin();
+           iter != launch_pending.end(); ) {
+        if (iter->launch >= launch_boundary) {
+          ++iter;
+          continue;
+        }
+        cudaError_t status = cudaEventQuery(iter->done);
+        if (status == cudaErrorNotReady) {
+          ++iter;
+          continue;
+        }
+        cudaChecked(status);
+        done.push_back(iter->done);
+        iter = launch_pending.erase(iter);
+      }
+      launch_done_free.insert(launch_done_free.end(), done.begin(), done.end());
+    }
+    launch_boundary_done += done.size();
+
+    return launches_numbered > launch_boundary &&
+      launch_boundary_done == rotate_launches;
+  }
+
+  // flush all slots regardless of their fill, along with the pending events
+  void drainSlots() {
+    consumeEvents();
+    for(int slot = 0; slot < slot_count; slot++) {
+      consumeSlot(&traceinfo.info_d.allocs_d[slot * CACHELINE],
+                  &traceinfo.info_d.commits_d[slot * CACHELINE],
+                  &traceinfo.signals_h[slot * CACHELINE],
+                  &traceinfo.flusheds_h[slot * CACHELINE],
+                  &traceinfo.flusheds_old[slot * CACHELINE],
+                  &traceinfo.info_d.records_d[slot * SLOT_SIZE],
+                  &traceinfo.records_h[slot * SLOT_SIZE],
+                  tracefile, false, traceinfo.flusheds_mapped, cudastream_trace,
+                  this);
+    }
+    consumeEvents();
+  }
+  
+  // flush all slots regardless of their fill, along with the pending
+  // events and tables, up to the last flush request
+  void drain() {
+    uint64_t request = flush_requested;
+    
+    drainSlots();
+    consumeTables(true);
+    if (! tracefile_flush(tracefile)) {
+      fprintf(stderr, "Trace Write Error!\n");
+    }
+    recorder_aligned = true;
+
+    {
+      std::lock_guard<std::mutex> lock(flush_mutex);
+      flush_done = request;
+    }
+    flush_cv.notify_all();
+  }
+  
+  // payload function of queue consumer
+  static void consume(TraceConsumer* obj) {
+
+    cudaSetDevice(obj->device);
     obj->does_run = true;
 
     uint8_t* allocs_d = obj->traceinfo.info_d.allocs_d;
@@ -543,6 +1682,7 @@ protected:
     uint8_t* signals_h = obj->traceinfo.signals_h;
     uint8_t* records_d = obj->traceinfo.info_d.records_d;
     uint8_t* records_h = obj->traceinfo.records_h;
+    bool flusheds_mapped = obj->traceinfo.flusheds_mapped;
     cudaStream_t cudastream_trace = obj->cudastream_trace;
 
     tracefile_t tracefile = obj->tracefile;
@@ -558,10 +1698,11 @@ protected:
     }
     */
     
-    uint32_t offset[SLOTS_PER_DEV];
-    uint32_t records_offset[SLOTS_PER_DEV];
+    int slot_count = obj->slot_count;
+    uint32_t offset[SLOTS_PER_DEV_MAX];
+    uint32_t records_offset[SLOTS_PER_DEV_MAX];
 
-    for(int slot = 0; slot < SLOTS_PER_DEV; slot++) {
+    for(int slot = 0; slot < slot_count; slot++) {
       offset[slot] = slot * CACHELINE;
       records_offset[slot] = slot * SLOT_SIZE;
     }
@@ -569,25 +1710,58 @@ protected:
     //while (!obj->to_be_terminated) {
       
     while(obj->should_run) {
-      for(int slot = 0; slot < SLOTS_PER_DEV; slot++) {
-        consumeSlot(&allocs_d[offset[slot]], &commits_d[offset[slot]],
+      if (obj->flush_requested != obj->flush_done) {
+        obj->drain();
+      }
+      
+      // host events first, as they are queued before the device work
+      // they describe (e.g. a launch record before its records)
+      obj->consumeEvents();
+      
+      uint32_t occupancy = 0;
+      for(int slot = 0; slot < slot_count; slot++) {
+        occupancy = std::max(occupancy, consumeSlot(&allocs_d[offset[slot]], &commits_d[offset[slot]],
                     &signals_h[offset[slot]], &flusheds_h[offset[slot]],
                     &flusheds_old[offset[slot]], &records_d[records_offset[slot]],
                     &records_h[records_offset[slot]],
-                    tracefile, true, cudastream_trace);
+                    tracefile, true, flusheds_mapped, cudastream_trace, obj));
           
       }
+      obj->consumeTables(false);
+      if (obj->sampling_max > 1) {
+        obj->adaptSampling(occupancy);
+      }
+
+      if (obj->launchSegmentDone()) {
+        // the records of the launches before the boundary are all
+        // committed, so none of them follows in the next segment
+        obj->drainSlots();
+        obj->consumeTables(false);
+        obj->rotate();
+        obj->launch_boundary += obj->rotate_launches;
+        obj->launch_boundary_done = 0;
+      } else if (obj->rotate_bytes &&
+                 tracefile->file_size + tracefile->buf_commits >= obj->rotate_bytes) {
+        obj->rotate();
+      }
+
+      if (obj->recorder_size) {
+        // the history starts at record boundaries only
+        if (! tracefile_flush(tracefile)) {
+          fprintf(stderr, "Trace Write Error!\n");
+        }
+        obj->recorder_aligned = true;
+        
+        uint64_t request = recorder_requests.load();
+        if (request > obj->recorder_done) {
+          obj->recorderDump(request);
+        }
+      }
     }
 
     // after should_run flag has been reset to false, no warps are writing, but
     // there might still be data in the buffers
-    for(int slot = 0; slot < SLOTS_PER_DEV; slot++) {
-      consumeSlot(&allocs_d[offset[slot]], &commits_d[offset[slot]],
-                  &signals_h[offset[slot]], &flusheds_h[offset[slot]],
-                  &flusheds_old[offset[slot]], &records_d[records_offset[slot]],
-                  &records_h[records_offset[slot]],
-                  tracefile, false, cudastream_trace);
-    }
+    obj->drain();
     /*
       std::unique_lock<std::mutex> lock_refresh_consume(obj->mtx_refresh_consume);
       obj->cv_refresh_consume.wait(lock_refresh_consume,
@@ -601,7 +1775,214 @@ protected:
     return;
   }
 
+  typedef struct {
+    const cuprof_plugin_t* plugin;
+    void* state;
+  } plugin_state_t;
+
+  // passes each flushed chunk of the trace file to the plugins
+  // and the flight recorder
+  static int traceSink(void* arg, const void* data, size_t size) {
+    TraceConsumer* obj = (TraceConsumer*) arg;
+    for (const plugin_state_t& plugin_state : obj->plugin_states) {
+      if (!plugin_state.plugin->write(plugin_state.state, data, size)) {
+        fprintf(stderr, "cuprof: plugin write failed on device %d\n",
+                obj->device);
+      }
+    }
+    if (obj->recorder_size) {
+      obj->recorderRecord((const byte*) data, size);
+    }
+    return 1;
+  }
+
+  // name of the <seq>th trace file with rotation, "<trace name>-<seq>.trc"
+  std::string segmentName(uint32_t seq) {
+    std::string name = pipe_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".trc") == 0) {
+      name.resize(name.size() - 4);
+    }
+    return name + "-" + std::to_string(seq) + ".trc";
+  }
+
+  // continue the trace in the next file, at a record boundary. Each file
+  // starts with its own preamble (header, kernels written so far, live
+  // allocations, latest launches...), so it can be read on its own;
+  // plugins keep receiving a single trace.
+  void rotate() {
+    std::string name = segmentName(++segment_seq);
+    if (! tracefile_reopen(tracefile, name.c_str())) {
+      fprintf(stderr, "unable to open trace file '%s' for writing\n",
+              name.c_str());
+      rotate_bytes = 0;
+      rotate_launches = 0;
+      return;
+    }
+    
+    tracefile_sink_t sink = tracefile->sink;
+    tracefile->sink = NULL;
+    if (writePreamble(tracefile, stateSince()) != 0 ||
+        ! tracefile_flush(tracefile)) {
+      fprintf(stderr, "Trace Write Error!\n");
+    }
+    tracefile->sink = sink;
+  }
+
+  // start of the trace that state records are kept for: the history of
+  // the flight recorder, or the current position for rotation
+  uint64_t stateSince() {
+    if (!recorder_size)
+      return UINT64_MAX;
+    return recorder_marks.empty() ? recorder_head : recorder_marks.front();
+  }
+
+  // drop the records of a key that precede its state at <since>;
+  // returns whether none of them matters to a preamble from <since> on
+  static bool pruneState(std::deque<state_record_t>& records, uint64_t since) {
+    while (records.size() > 1 && records[1].pos <= since) {
+      records.pop_front();
+    }
+    const state_record_t& last = records.back();
+    return records.size() == 1 && last.pos <= since &&
+      last.event.type == HOSTREC_ALLOC && ALLOC_KIND_IS_FREE(last.event.payload[3]);
+  }
+
+  // keep a host record that sets the state of trace readers, at the
+  // position of the trace it is about to be written to
+  void keepState(uint32_t type, uint64_t key, const uint64_t* payload,
+                 uint32_t unit) {
+    if (!recorder_size && !rotate_bytes && !rotate_launches)
+      return;
+
+    state_record_t record = {};
+    record.pos = recorder_size ? recorder_head + tracefile->buf_commits : 0;
+    record.event.type = type;
+    record.event.unit = std::min(unit, (uint32_t)HOSTREC_EVENT_UNIT_MAX);
+    memcpy(record.event.payload, payload, record.event.unit * sizeof(uint64_t));
+
+    uint64_t since = stateSince();
+    std::deque<state_record_t>& records = state_records[{type, key}];
+    records.push_back(record);
+    pruneState(records, since);
+
+    // freed allocations and records that left the history, now and then
+    if (++state_kept >= 2 * state_records.size() + 1024) {
+      for (auto iter = state_records.begin(); iter != state_records.end(); ) {
+        iter = pruneState(iter->second, since)
+          ? state_records.erase(iter) : std::next(iter);
+      }
+      state_kept = 0;
+    }
+  }
+
+  // write what a reader needs to decode the trace from position <since>
+  // on: the header, the kernels written so far, and the state in effect
+  // at <since> (live allocations, latest launch and launch sampling of
+  // each kernel, clock calibration, sampling divisor)
+  int writePreamble(tracefile_t out, uint64_t since) {
+    int err = trace_write_header(out, "", 0);
+    for (const written_kernel_t& kernel : written_kernels) {
+      err |= trace_write_kernel(out, kernel.kernid,
+                                (const byte*) kernel.kdata,
+                                kernel.kdata_size);
+    }
+    
+    for (const auto& entry : state_records) {
+      const state_record_t* state = nullptr;
+      for (const state_record_t& record : entry.second) {
+        if (record.pos >= since)
+          break;
+        state = &record;
+      }
+      if (!state || (state->event.type == HOSTREC_ALLOC &&
+                     ALLOC_KIND_IS_FREE(state->event.payload[3]))) {
+        continue;
+      }
+      err |= trace_write_hostrec(out, state->event.type, state->event.payload,
+                                 state->event.unit * sizeof(uint64_t));
+    }
+    return err;
+  }
+
+  // append a chunk of the trace to the history of the flight recorder,
+  // dropping the oldest data. The history is kept as a byte ring, with
+  // the offsets of some chunks starting at record boundaries, where
+  // dumps can start.
+  void recorderRecord(const byte* data, size_t size) {
+    if (!recorder_header_done)
+      return;
+
+    if (recorder_aligned &&
+        (recorder_marks.empty() ||
+         recorder_head - recorder_marks.back() >= recorder_size / 256)) {
+      recorder_marks.push_back(recorder_head);
+    }
+    recorder_aligned = false;
+
+    if (size > recorder_size) {
+      recorder_head += size - recorder_size;
+      data += size - recorder_size;
+      size = recorder_size;
+    }
+    while (size > 0) {
+      size_t offset = recorder_head % recorder_size;
+      size_t part = std::min(size, recorder_size - offset);
+      memcpy(recorder_ring.data() + offset, data, part);
+      recorder_head += part;
+      data += part;
+      size -= part;
+    }
+
+    while (!recorder_marks.empty() &&
+           recorder_head - recorder_marks.front() > recorder_size) {
+      recorder_marks.pop_front();
+    }
+  }
+
+  // write the preamble and the history of the flight recorder
+  // to a new trace file, "<trace name>-flight-<n>.trc"
+  void recorderDump(uint64_t request) {
+    std::string name = pipe_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".trc") == 0) {
+      name.resize(name.size() - 4);
+    }
+    name += "-flight-" + std::to_string(++recorder_dumps) + ".trc";
+
+    tracefile_t dump = trace_write_open(name.c_str());
+    if (dump == NULL) {
+      fprintf(stderr, "unable to open trace file '%s' for writing\n",
+              name.c_str());
+    } else {
+      // kernels and state written before the history, to decode it
+      uint64_t pos = stateSince();
+      bool ok = writePreamble(dump, pos) == 0;
+      while (pos < recorder_head) {
+        size_t offset = pos % recorder_size;
+        size_t part = std::min({(size_t) (recorder_head - pos),
+                                recorder_size - offset,
+                                (size_t) TRACEFILE_BUF_SIZE / 2});
+        ok = tracefile_write(dump, recorder_ring.data() + offset, part) && ok;
+        pos += part;
+      }
+      ok = trace_write_close(dump) && ok;
+
+      if (ok) {
+        fprintf(stderr, "cuprof: flight recorder of device %d written to '%s'\n",
+                device, name.c_str());
+      } else {
+        fprintf(stderr, "Trace Write Error!\n");
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(flush_mutex);
+      recorder_done = request;
+    }
+    flush_cv.notify_all();
+  }
+
   int device;
+  int slot_count;
   bool header_written;
 
   std::atomic<bool> should_run;
@@ -613,6 +1994,44 @@ protected:
   //std::condition_variable cv_refresh_consume;
 
   tracefile_t tracefile;
+  std::vector<plugin_state_t> plugin_states;
+
+  // kernels written to the trace, to start flight recorder dumps
+  // and rotated trace files with (consumer thread only)
+  typedef struct {
+    uint64_t kernid;
+    uint64_t kdata;      // const byte*
+    uint64_t kdata_size;
+  } written_kernel_t;
+  std::vector<written_kernel_t> written_kernels;
+
+  // trace file rotation, used by the consumer thread only (0: off)
+  uint64_t rotate_bytes;
+  std::atomic<uint64_t> rotate_launches;
+  uint32_t segment_seq;
+
+  // launches numbered by launchBegin(), ended by launchEnd(); segments end
+  // before each rotate_launches-th launch after the first (launch_boundary)
+  typedef struct {
+    uint64_t launch;
+    cudaEvent_t done;   // recorded on the launch stream after the launch
+  } launch_done_t;
+  std::atomic<uint64_t> launches_numbered;
+  std::vector<launch_done_t> launch_pending;
+  std::vector<cudaEvent_t> launch_done_free;
+  std::mutex launch_mutex;
+  uint64_t launch_boundary;       // consumer thread only
+  uint64_t launch_boundary_done;  // launches before it that have ended
+  
+  // flight recorder, used by the consumer thread only (0 size: off)
+  size_t recorder_size;
+  std::vector<byte> recorder_ring;
+  uint64_t recorder_head;              // bytes recorded so far
+  std::deque<uint64_t> recorder_marks; // dump starts, by recorded bytes
+  bool recorder_aligned;               // next chunk starts a record
+  bool recorder_header_done;
+  uint32_t recorder_dumps;
+  std::atomic<uint64_t> recorder_done; // last handled dump request
   std::thread worker_thread;
   std::string pipe_name;
 
@@ -621,178 +2040,842 @@ protected:
   cudaStream_t cudastream_trace;
   std::vector<cudaStream_t> stream;
   std::mutex stream_mutex;
+
+  // adaptive sampling state, owned by the consumer thread
+  uint32_t* sampling_h;    // pinned staging word of traceinfo.info_d.sampling_d
+  uint32_t sampling_max;
+  uint32_t sampling_div;
+  uint64_t sampling_time;  // start of the current decision period
+  uint32_t sampling_occupancy;
+  bool sampling_stalled;
+
+  uint64_t* addr_ranges_h; // pinned staging of traceinfo.info_d.addr_ranges_d
+  std::mutex addr_ranges_mutex;
+
+  uint32_t* control_h;     // pinned staging of traceinfo.info_d.control_d
+  std::mutex control_mutex;
+
+  // flush requests of the host API, served by the consumer thread
+  std::atomic<uint64_t> flush_requested;
+  std::atomic<uint64_t> flush_done;
+  std::mutex flush_mutex;
+  std::condition_variable flush_cv;
+
+  typedef struct table_fetch_t {
+    uint8_t* buf;          // pinned; {kernel id, entry count, table}
+    size_t buf_size;
+    size_t table_size;
+    uint32_t type;         // HOSTREC_*
+    uint32_t kernid;
+    cudaEvent_t done;
+    launch_data_t release; // freed once fetched, if any
+  } table_fetch_t;
+  
+  std::vector<table_fetch_t> table_pending;
+  std::vector<table_fetch_t> table_free;
+  std::vector<launch_data_t> launch_data_free;
+  std::mutex table_mutex; // also guards launch_data_free
+
+  std::vector<host_event_t> event_pending;
+  std::mutex event_mutex;
+  std::vector<bool> kernels_written; // by kernel id, guarded by event_mutex
+
+  // host records setting the state of trace readers, kept to start flight
+  // recorder dumps and rotated trace files with (consumer thread only):
+  // by {type, allocation base or kernel id}, the records since the
+  // latest one before stateSince(), with their trace positions
+  std::map<std::pair<uint32_t, uint64_t>,
+           std::deque<state_record_t>> state_records;
+  uint64_t state_kept;     // records kept since the last full prune
   
 };
 
 /*******************************************************************************
  * TraceManager acts as a cache for TraceConsumers and ensures only one consumer
- * per stream is exists. RAII on global variable closes files etc.
+ * per device exists. RAII on global variable closes files etc.
  * CUDA API calls not allowed inside of stream callback, so TraceConsumer
  * initialization must be performed explicitly;
+ * Consumers are created on the first use of their device by the runtime
+ * (instrumented launch, allocation, memory transfer), so that devices not
+ * used by the process cost no buffers, threads or files.
  */
 #define MAX_DEV_COUNT 256
+static void recorderSignalsSetUp();
+
 class TraceManager {
 public:
   
   TraceManager() {
-    initConsumers();
-  }
+    // used on destruction, so construct them first to outlive the manager
+    kernelInfos();
+    kernelIds();
+    kernelsMutex();
+    controlMutex();
+    launchSampling();
+
+    addrRangesFromEnv(addr_ranges);
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      consumers[device] = nullptr;
+    }
+    closing = false;
 
-  void initConsumers() {
-    if (consumers != nullptr)
-      return;
-    
-    cudaChecked(cudaGetDeviceCount(&device_count));
-    consumers = new TraceConsumer*[device_count];
-    
-    for (int device = 0; device < device_count; device++) {
-      consumers[device] = new TraceConsumer(device);
+    if (flightRecorderSize()) {
+      recorderSignalsSetUp();
     }
   }
 
   
+  // nullptr if the device has not been used yet
   TraceConsumer* getConsumer(int device) {
-    if (device >= device_count)
+    if (device < 0 || device >= MAX_DEV_COUNT)
       return nullptr;
     else
-      return consumers[device];
+      return consumers[device].load(std::memory_order_acquire);
+  }
+
+  // the consumer of the device, created on first use;
+  // must precede any instrumented kernel on the device, which reads the
+  // trace info set by the consumer.
+  // nullptr once the manager is destroyed, e.g. for CUDA calls of later
+  // static destructors or atexit handlers
+  TraceConsumer* getOrCreateConsumer(int device) {
+    TraceConsumer* consumer = getConsumer(device);
+    if (consumer || device < 0 || device >= MAX_DEV_COUNT)
+      return consumer;
+
+    std::lock_guard<std::mutex> lock(consumers_mutex);
+    consumer = consumers[device].load(std::memory_order_relaxed);
+    if (consumer || closing)
+      return consumer;
+
+    consumer = new TraceConsumer(device, addr_ranges);
+    {
+      // publish with the latest control table,
+      // as control updates only reach published consumers
+      std::lock_guard<std::mutex> control_lock(controlMutex());
+      consumer->setControl(controlTable());
+      consumers[device].store(consumer, std::memory_order_release);
+    }
+    return consumer;
+  }
+
+  // add the kernels of a module, and set their ids on the devices used so
+  // far (modules set up after the first use of devices, e.g. dlopen'ed).
+  // Under consumers_mutex, so that consumers created meanwhile either
+  // see the kernels on construction or are set here.
+  void addKernels(std::vector<kernel_info_t>& infos) {
+    std::lock_guard<std::mutex> lock(consumers_mutex);
+    uint32_t kernid_begin, kernid_end;
+    {
+      std::lock_guard<std::mutex> kernels_lock(kernelsMutex());
+      kernid_begin = kernelInfos().size();
+      for (kernel_info_t& info : infos) {
+        kernelIds()[info.kid_sym] = kernelInfos().size();
+        kernelInfos().push_back(std::move(info));
+      }
+      kernid_end = kernelInfos().size();
+      ___cuprof_kernel_count.store(kernid_end - 1, std::memory_order_release);
+    }
+    
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      if (TraceConsumer* consumer = getConsumer(device))
+        consumer->setKernelIds(kernid_begin, kernid_end);
+    }
+  }
+
+  void setAddrRanges(const uint64_t* table) {
+    std::lock_guard<std::mutex> lock(consumers_mutex);
+    memcpy(addr_ranges, table, ADDR_RANGE_TABLE_UNIT * sizeof(uint64_t));
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      if (TraceConsumer* consumer = getConsumer(device))
+        consumer->setAddrRanges(table);
+    }
+  }
+
+  void setControl(const uint32_t* table) {
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      if (TraceConsumer* consumer = getConsumer(device))
+        consumer->setControl(table);
+    }
+  }
+
+  // queue a host record to the traces of all devices used so far
+  void pushEvent(uint32_t type, const uint64_t* payload, uint32_t unit) {
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      if (TraceConsumer* consumer = getConsumer(device))
+        consumer->pushEvent(type, payload, unit);
+    }
+  }
+
+  // wait for all devices used so far, then flush their traces
+  // returns false if a device failed to synchronize
+  bool flush() {
+    int initial_device;
+    cudaChecked(cudaGetDevice(&initial_device));
+
+    bool result = true;
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      TraceConsumer* consumer = getConsumer(device);
+      if (!consumer)
+        continue;
+      
+      cudaChecked(cudaSetDevice(device));
+      if (cudaDeviceSynchronize() != cudaSuccess) {
+        result = false;
+        continue;
+      }
+      consumer->flush();
+    }
+
+    cudaChecked(cudaSetDevice(initial_device));
+    return result;
+  }
+
+  // flush, then dump the flight recorders of all devices used so far
+  // returns false if the flight recorder is off or the flush failed
+  bool dump() {
+    if (!flightRecorderSize())
+      return false;
+    
+    bool result = flush();
+    uint64_t request = ++recorder_requests;
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      if (TraceConsumer* consumer = getConsumer(device))
+        consumer->waitDump(request);
+    }
+    return result;
+  }
+
+  // whether all flight recorders have handled the dump request;
+  // async-signal-safe
+  bool dumped(uint64_t request) {
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      TraceConsumer* consumer = getConsumer(device);
+      if (consumer && !consumer->dumped(request))
+        return false;
+    }
+    return true;
   }
 
   
   virtual ~TraceManager() {
-    if (consumers == nullptr)
-      return;
+    // final launch counts of the kernels with skipped launches,
+    // as launches after the last traced one are not recorded otherwise
+    {
+      std::lock_guard<std::mutex> lock(controlMutex());
+      const launch_sampling_t& policy = launchSampling();
+      for (uint32_t kernid = 1; kernid <= kernelCount(); kernid++) {
+        const kernel_info_t& info = kernelInfo(kernid);
+        if (info.launches_skipped == 0)
+          continue;
+        
+        uint64_t payload[HOSTREC_LAUNCH_SAMPLING_UNIT] = {
+          monotonic_ns(), kernid, info.launches, info.launches_skipped,
+          policy.first, policy.every, policy.from, policy.to
+        };
+        for (int device = 0; device < MAX_DEV_COUNT; device++) {
+          if (TraceConsumer* consumer = getConsumer(device))
+            consumer->pushKernel(kernid, info.kdata, info.kdata_size);
+        }
+        pushEvent(HOSTREC_LAUNCH_SAMPLING, payload, HOSTREC_LAUNCH_SAMPLING_UNIT);
+      }
+    }
     
-    for (int device = 0; device < device_count; device++) {
-      if (consumers[device])
-        delete consumers[device];
+    // unpublish each consumer before deleting it, so that later callers
+    // find no consumer instead of a deleted one, and create none
+    {
+      std::lock_guard<std::mutex> lock(consumers_mutex);
+      closing = true;
+    }
+    for (int device = 0; device < MAX_DEV_COUNT; device++) {
+      TraceConsumer* consumer;
+      {
+        std::lock_guard<std::mutex> lock(consumers_mutex);
+        consumer = consumers[device].exchange(nullptr, std::memory_order_acq_rel);
+      }
+      delete consumer;
     }
-    delete[] consumers;
   }
   
   
 private:
-  TraceConsumer** consumers;
-  int device_count;
+  std::atomic<TraceConsumer*> consumers[MAX_DEV_COUNT];
+  std::mutex consumers_mutex;
+  bool closing;  // no more consumers, guarded by consumers_mutex
+  uint64_t addr_ranges[ADDR_RANGE_TABLE_UNIT]; // for consumers created later
 };
 
 static TraceManager ___cuprof_trace_manager;
 
+/*******************************************************************************
+ * Flight recorder dumps on signals: SIGUSR1 requests a dump of all devices,
+ * and abort() waits up to a second for the dumps before terminating.
+ */
+static struct sigaction recorder_abort_old;
+
+static void recorderSignal(int signum) {
+  recorder_requests++;
+}
+
+static void recorderAbort(int signum) {
+  uint64_t request = ++recorder_requests;
+  struct timespec wait = {0, 1000000}; // 1ms
+  for (int i = 0; i < 1000 && !___cuprof_trace_manager.dumped(request); i++) {
+    nanosleep(&wait, NULL);
+  }
+  
+  // terminate as without the handler, on return
+  sigaction(SIGABRT, &recorder_abort_old, NULL);
+  raise(SIGABRT);
+}
+
+static void recorderSignalsSetUp() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  
+  action.sa_handler = recorderSignal;
+  sigaction(SIGUSR1, &action, NULL);
+  action.sa_handler = recorderAbort;
+  sigaction(SIGABRT, &action, &recorder_abort_old);
+}
+
 /*******************************************************************************
  * C Interface
  */
 
 extern "C" {
   
-  void ___cuprof_init() {
-    if (!___cuprof_accdat_var) {
-      ___cuprof_accdat_var = (char*) malloc(sizeof(char));
+  void ___cuprof_gvsym_set_up(const void* basedat_sym) {
+    if (!___cuprof_trace_base_info) {
+      ___cuprof_trace_base_info = (traceinfo_t*) basedat_sym;
     }
   }
-  
-  void ___cuprof_term() {
-    if (___cuprof_accdat_var) {
-      free(___cuprof_accdat_var);
-      ___cuprof_accdat_var = NULL;
+
+  // set up the kernels of a module (KERNEL_SYM_UNIT symbols each),
+  // from a global ctor of the module. No CUDA calls: kernel ids are set
+  // and kernel metadata is fetched on the first use of a device.
+  void ___cuprof_module_set_up(const void* const* kernel_syms,
+                               uint32_t kernel_count) {
+    std::vector<kernel_info_t> infos;
+    for (uint32_t i = 0; i < kernel_count; i++) {
+      const void* const* syms = kernel_syms + i * KERNEL_SYM_UNIT;
+
+      kernel_info_t kernel_info = {syms[KERNEL_SYM_AGG] != NULL, 0};
+      kernel_info.launches = 0;
+      kernel_info.launches_skipped = 0;
+      kernel_info.launch_last = 0;
+      kernel_info.kdata_sym = syms[KERNEL_SYM_DATA];
+      kernel_info.kid_sym = syms[KERNEL_SYM_ID];
+      infos.push_back(kernel_info);
     }
+
+    ___cuprof_trace_manager.addKernels(infos);
   }
 
-  void ___cuprof_gvsym_set_up(const void* basedat_sym) {
-    if (!___cuprof_trace_base_info) {
-      ___cuprof_trace_base_info = (traceinfo_t*) basedat_sym;
+
+  // number of a traced launch for rotation by launches (launchBegin()),
+  // from ___cuprof_kernel_launch() to ___cuprof_kernel_fetch() of the launch
+  static thread_local uint64_t launch_numbered = UINT64_MAX;
+
+  // launch data of the launch being made by the thread, set up by
+  // ___cuprof_kernel_launch() if the launch is traced, passed to the
+  // instrumented kernel by the host pass (___cuprof_launch_data()),
+  // and fetched by ___cuprof_kernel_fetch()
+  static thread_local TraceConsumer::launch_data_t launch_data = {};
+
+  void ___cuprof_kernel_fetch(const void* kid_sym, cudaStream_t stream,
+                              uint32_t traced) {
+    int device;
+    cudaChecked(cudaGetDevice(&device));
+
+    uint64_t launch = launch_numbered;
+    launch_numbered = UINT64_MAX;
+    TraceConsumer::launch_data_t data = launch_data;
+    launch_data = TraceConsumer::launch_data_t();
+    
+    if (!traced || !data.ptr)
+      return;
+
+    TraceConsumer* consumer = ___cuprof_trace_manager.getConsumer(device);
+    if (!consumer)
+      return;
+    
+    uint32_t kernid = kernelId(kid_sym);
+    consumer->fetchLaunch(kernid, data, kernelInfo(kernid).aggdat_size, stream);
+
+    if (launch != UINT64_MAX) {
+      consumer->launchEnd(launch, stream);
     }
   }
 
-  void ___cuprof_kernel_set_up(const void* kdata_sym, const void* kid_sym) {
 
-    ___cuprof_kernel_count++;
 
-    // set kernel id for all devices
-    int initial_device;
-    cudaChecked(cudaGetDevice(&initial_device));
-    int dev_count;
-    cudaChecked(cudaGetDeviceCount(&dev_count));
+/*******************************************************************************
+ * Allocation / memory transfer tracking
+ * The host pass redirects calls of the application to these wrappers.
+ */
 
-    for (int i = 0; i < dev_count; i++) {
-      cudaChecked(cudaSetDevice(i));
-      cudaChecked(cudaMemcpyToSymbol(kid_sym, &___cuprof_kernel_count, sizeof(uint32_t)));
-    }
+  // queue a host record to the trace of the current device
+  static void ___cuprof_host_event(uint32_t type, const uint64_t* payload,
+                                   uint32_t unit) {
+    int device;
+    if (cudaGetDevice(&device) != cudaSuccess)
+      return;
+    TraceConsumer* consumer = ___cuprof_trace_manager.getOrCreateConsumer(device);
+    if (!consumer)
+      return;
 
-    cudaChecked(cudaSetDevice(initial_device));
-    
+    consumer->pushEvent(type, payload, unit);
+  }
+  
 
-    // get kernel access data from device, and append to host-side var
-    size_t kdata_size;
-    cudaChecked(cudaGetSymbolSize(&kdata_size, kdata_sym));
+  static void ___cuprof_alloc_event(uint32_t kind, const void* ptr, size_t size,
+                                    const void* call_site) {
+    uint64_t base = (uint64_t) ptr;
+    {
+      std::lock_guard<std::mutex> lock(allocSizesMutex());
+      if (ALLOC_KIND_IS_FREE(kind)) {
+        auto found = allocSizes().find(base);
+        if (found != allocSizes().end()) {
+          size = found->second;
+          allocSizes().erase(found);
+        }
+      } else {
+        allocSizes()[base] = size;
+      }
+    }
     
+    uint64_t payload[HOSTREC_ALLOC_UNIT] = {
+      monotonic_ns(), base, size, kind, (uint64_t) call_site
+    };
+    ___cuprof_host_event(HOSTREC_ALLOC, payload, HOSTREC_ALLOC_UNIT);
+  }
+  
+  cudaError_t ___cuprof_cudaMalloc(void** dev_ptr, size_t size) {
+    cudaError_t result = cudaMalloc(dev_ptr, size);
+    if (result == cudaSuccess) {
+      ___cuprof_alloc_event(ALLOC_KIND_MALLOC, *dev_ptr, size,
+                            __builtin_return_address(0));
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMallocManaged(void** dev_ptr, size_t size,
+                                          unsigned int flags) {
+    cudaError_t result = cudaMallocManaged(dev_ptr, size, flags);
+    if (result == cudaSuccess) {
+      ___cuprof_alloc_event(ALLOC_KIND_MANAGED, *dev_ptr, size,
+                            __builtin_return_address(0));
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaFree(void* dev_ptr) {
+    cudaError_t result = cudaFree(dev_ptr);
+    if (result == cudaSuccess && dev_ptr) {
+      ___cuprof_alloc_event(ALLOC_KIND_FREE, dev_ptr, 0,
+                            __builtin_return_address(0));
+    }
+    return result;
+  }
+
+#if CUDART_VERSION >= 11020
+  
+  // stream-ordered: the event is timed at the call, not in stream order
+  cudaError_t ___cuprof_cudaMallocAsync(void** dev_ptr, size_t size,
+                                        cudaStream_t stream) {
+    cudaError_t result = cudaMallocAsync(dev_ptr, size, stream);
+    if (result == cudaSuccess) {
+      ___cuprof_alloc_event(ALLOC_KIND_MALLOC_ASYNC, *dev_ptr, size,
+                            __builtin_return_address(0));
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaFreeAsync(void* dev_ptr, cudaStream_t stream) {
+    cudaError_t result = cudaFreeAsync(dev_ptr, stream);
+    if (result == cudaSuccess && dev_ptr) {
+      ___cuprof_alloc_event(ALLOC_KIND_FREE_ASYNC, dev_ptr, 0,
+                            __builtin_return_address(0));
+    }
+    return result;
+  }
+
+#endif
+
+
+
+  static void ___cuprof_memop_event(uint32_t kind, uint32_t direction,
+                                    const void* dst, uint64_t src, uint64_t size,
+                                    cudaStream_t stream, uint64_t host_begin) {
+    if (!tracingEnabled())
+      return;
     
-    char* var_tmp = (char*) realloc(___cuprof_accdat_var,
-                                    ___cuprof_accdat_varlen + kdata_size + 1);
-    if (!var_tmp) {
-      fprintf(stderr, "Failed to initialize memory access data!\n");
-      abort();
+    uint64_t payload[HOSTREC_MEMOP_UNIT] = {
+      host_begin, monotonic_ns(), kind, direction,
+      (uint64_t) dst, src, size, (uint64_t) stream
+    };
+    ___cuprof_host_event(HOSTREC_MEMOP, payload, HOSTREC_MEMOP_UNIT);
+  }
+
+  // device address of a symbol, for the event of a symbol copy
+  static const void* ___cuprof_symbol_addr(const void* symbol) {
+    void* addr = nullptr;
+    if (cudaGetSymbolAddress(&addr, symbol) != cudaSuccess) {
+      cudaGetLastError(); // not a device symbol; do not leave the error
+      return symbol;
     }
+    return addr;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpy(void* dst, const void* src, size_t count,
+                                   enum cudaMemcpyKind kind) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpy(dst, src, count, kind);
+    if (result == cudaSuccess) {
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY, kind, dst, (uint64_t) src,
+                            count, 0, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpyAsync(void* dst, const void* src, size_t count,
+                                        enum cudaMemcpyKind kind,
+                                        cudaStream_t stream) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpyAsync(dst, src, count, kind, stream);
+    if (result == cudaSuccess) {
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY, kind, dst, (uint64_t) src,
+                            count, stream, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpy2D(void* dst, size_t dpitch,
+                                     const void* src, size_t spitch,
+                                     size_t width, size_t height,
+                                     enum cudaMemcpyKind kind) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpy2D(dst, dpitch, src, spitch,
+                                      width, height, kind);
+    if (result == cudaSuccess) {
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY_2D, kind, dst, (uint64_t) src,
+                            width * height, 0, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpy2DAsync(void* dst, size_t dpitch,
+                                          const void* src, size_t spitch,
+                                          size_t width, size_t height,
+                                          enum cudaMemcpyKind kind,
+                                          cudaStream_t stream) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpy2DAsync(dst, dpitch, src, spitch,
+                                           width, height, kind, stream);
+    if (result == cudaSuccess) {
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY_2D, kind, dst, (uint64_t) src,
+                            width * height, stream, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpyToSymbol(const void* symbol, const void* src,
+                                           size_t count, size_t offset,
+                                           enum cudaMemcpyKind kind) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpyToSymbol(symbol, src, count, offset, kind);
+    if (result == cudaSuccess) {
+      const uint8_t* dst = (const uint8_t*) ___cuprof_symbol_addr(symbol) + offset;
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY_SYMBOL, kind, dst, (uint64_t) src,
+                            count, 0, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpyToSymbolAsync(const void* symbol, const void* src,
+                                                size_t count, size_t offset,
+                                                enum cudaMemcpyKind kind,
+                                                cudaStream_t stream) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpyToSymbolAsync(symbol, src, count, offset,
+                                                 kind, stream);
+    if (result == cudaSuccess) {
+      const uint8_t* dst = (const uint8_t*) ___cuprof_symbol_addr(symbol) + offset;
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY_SYMBOL, kind, dst, (uint64_t) src,
+                            count, stream, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpyFromSymbol(void* dst, const void* symbol,
+                                             size_t count, size_t offset,
+                                             enum cudaMemcpyKind kind) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpyFromSymbol(dst, symbol, count, offset, kind);
+    if (result == cudaSuccess) {
+      const uint8_t* src = (const uint8_t*) ___cuprof_symbol_addr(symbol) + offset;
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY_SYMBOL, kind, dst, (uint64_t) src,
+                            count, 0, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemcpyFromSymbolAsync(void* dst, const void* symbol,
+                                                  size_t count, size_t offset,
+                                                  enum cudaMemcpyKind kind,
+                                                  cudaStream_t stream) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemcpyFromSymbolAsync(dst, symbol, count, offset,
+                                                   kind, stream);
+    if (result == cudaSuccess) {
+      const uint8_t* src = (const uint8_t*) ___cuprof_symbol_addr(symbol) + offset;
+      ___cuprof_memop_event(MEMOP_KIND_MEMCPY_SYMBOL, kind, dst, (uint64_t) src,
+                            count, stream, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemset(void* dev_ptr, int value, size_t count) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemset(dev_ptr, value, count);
+    if (result == cudaSuccess) {
+      ___cuprof_memop_event(MEMOP_KIND_MEMSET, MEMOP_DIR_NONE, dev_ptr,
+                            (uint64_t) value, count, 0, host_begin);
+    }
+    return result;
+  }
+
+  cudaError_t ___cuprof_cudaMemsetAsync(void* dev_ptr, int value, size_t count,
+                                        cudaStream_t stream) {
+    uint64_t host_begin = monotonic_ns();
+    cudaError_t result = cudaMemsetAsync(dev_ptr, value, count, stream);
+    if (result == cudaSuccess) {
+      ___cuprof_memop_event(MEMOP_KIND_MEMSET, MEMOP_DIR_NONE, dev_ptr,
+                            (uint64_t) value, count, stream, host_begin);
+    }
+    return result;
+  }
+
+
+
+/*******************************************************************************
+ * Kernel launch tracking
+ * The host pass calls this right before each launch of an instrumented
+ * kernel. The record is taken at enqueue time on the host, which leaves the
+ * launch stream alone (unlike a stream callback, which would serialize it).
+ * Launch sampling is decided here as well.
+ */
+
+  /** Kernels to be traced, from CUPROF_KERNELS ("name,name,...", as in the
+   * traces), applied as the filter of cuprofSetFilter() at the first launch,
+   * when the kernels of the program are set up.
+   * Default: all kernels
+   */
+  static void ___cuprof_kernels_from_env() {
+    const char* kernels_env = getenv("CUPROF_KERNELS");
+    if (!kernels_env)
+      return;
+
+    std::vector<std::string> names;
+    const char* pos = kernels_env;
+    while (*pos != '\0') {
+      const char* end = strchr(pos, ',');
+      if (!end)
+        end = pos + strlen(pos);
+      if (end != pos)
+        names.push_back(std::string(pos, end - pos));
+      pos = (*end == ',') ? end + 1 : end;
+    }
+
+    std::vector<const char*> names_c;
+    for (const std::string& name : names) {
+      names_c.push_back(name.c_str());
+    }
+    if (cuprofSetFilter(names_c.data(), names_c.size()) != 0) {
+      fprintf(stderr, "CUPROF_KERNELS: unknown kernel or more than %d kernels, "
+              "tracing all kernels\n", KERNEL_FILTER_MAX);
+    }
+  }
+
+  // returns whether the launch is traced; if not, the host pass launches the
+  // uninstrumented copy of the kernel instead, if the kernel has one (dual)
+  uint32_t ___cuprof_kernel_launch(const void* kid_sym,
+                                   uint64_t grid_dim, uint32_t grid_dim_z,
+                                   uint64_t cta_dim, uint32_t cta_dim_z,
+                                   size_t shared_mem, cudaStream_t stream) {
+    static std::atomic<uint64_t> launch_seq(0);
+    static std::once_flag kernels_env_once;
+    std::call_once(kernels_env_once, ___cuprof_kernels_from_env);
+
+    // set up tracing of the device before its first instrumented kernel
+    int device;
+    cudaChecked(cudaGetDevice(&device));
+    TraceConsumer* consumer = ___cuprof_trace_manager.getOrCreateConsumer(device);
+    kernelsFetch();
     
+    uint32_t kernid = kernelId(kid_sym);
+
+    uint64_t sampling_payload[HOSTREC_LAUNCH_SAMPLING_UNIT];
+    bool sampling_recorded;
+    bool sampled = launchCount(kernid, sampling_payload, &sampling_recorded);
+    if (launchSlow(kernid)) {
+      recorder_requests++;
+    }
     
-    const char* kdata;
-    cudaChecked(cudaMemcpyFromSymbol(var_tmp + ___cuprof_accdat_varlen,
-                                     kdata_sym, kdata_size));
-    var_tmp[___cuprof_accdat_varlen + kdata_size] = '\0';
+    if (!sampled || !kernelTraced(kernid))
+      return 0;
+
+    // the launch traces (and aggregates) into data of its own
+    if (consumer && kernid != 0) {
+      launch_data = consumer->launchData(kernelInfo(kernid).aggdat_size, stream);
+    }
+
+    // metadata of the kernel, before any record of it
+    if (consumer && kernid != 0) {
+      const kernel_info_t& info = kernelInfo(kernid);
+      consumer->pushKernel(kernid, info.kdata, info.kdata_size);
+    }
     
-    ___cuprof_accdat_var = var_tmp;
-    ___cuprof_accdat_varlen += kdata_size;
+    uint64_t payload[HOSTREC_LAUNCH_UNIT] = {
+      monotonic_ns(), kernid, launch_seq++,
+      grid_dim, grid_dim_z, cta_dim, cta_dim_z,
+      shared_mem, (uint64_t) stream
+    };
+    if (consumer) {
+      launch_numbered = consumer->launchBegin();
+    }
+    ___cuprof_host_event(HOSTREC_LAUNCH, payload, HOSTREC_LAUNCH_UNIT);
+    if (sampling_recorded) {
+      sampling_payload[0] = payload[0];
+      ___cuprof_host_event(HOSTREC_LAUNCH_SAMPLING, sampling_payload,
+                           HOSTREC_LAUNCH_SAMPLING_UNIT);
+    }
+    return 1;
   }
 
 
-/*
-  
-  static void ___cuprof_trace_start_callback(cudaStream_t stream, cudaError_t status, void* vargs) {
-    kernel_trace_arg_t* vargs_cast = (kernel_trace_arg_t*)vargs;
-    int device = vargs_cast->device;
-    
-    TraceConsumer* consumer = ___cuprof_trace_manager.getConsumer(device);
-    consumer->start(stream, vargs_cast->kernel_name,
-                    vargs_cast->kernel_grid_dim, vargs_cast->kernel_cta_size);
-    free(vargs);
+
+  // the launch data of the launch, right before the launch API call;
+  // NULL if the threads of the instrumented kernel skip their trace calls,
+  // as for launches not recorded by ___cuprof_kernel_launch()
+  void* ___cuprof_launch_data() {
+    return launch_data.ptr;
   }
 
-  static void ___cuprof_trace_stop_callback(cudaStream_t stream, cudaError_t status, void* vargs) {
-    int* device_ptr = (int*)vargs;
-    int device = *device_ptr;
-    
-    TraceConsumer* consumer = ___cuprof_trace_manager.getConsumer(device);
-    consumer->stop(stream);
+
+
+/*******************************************************************************
+ * Host API (cuprof.h)
+ */
+
+  int cuprofSetAddrRanges(const cuprof_addr_range_t* ranges, unsigned int count) {
+    if (count > CUPROF_ADDR_RANGE_MAX || (count != 0 && !ranges))
+      return -1;
+
+    uint64_t table[ADDR_RANGE_TABLE_UNIT] = {count};
+    for (unsigned int i = 0; i < count; i++) {
+      table[1 + 2*i] = (uint64_t) ranges[i].base;
+      table[2 + 2*i] = ranges[i].size;
+    }
     
-    free(vargs);
+    ___cuprof_trace_manager.setAddrRanges(table);
+    return 0;
+  }
+
+  // apply the control table to all devices;
+  // called with controlMutex() held, so that updates are applied in order
+  static void ___cuprof_control_update() {
+    ___cuprof_trace_manager.setControl(controlTable());
   }
   
-  
-  void ___cuprof_trace_start(int device, cudaStream_t stream, const char* kernel_name,
-                            uint64_t grid_dim, uint16_t cta_size) {
-    return;
-    
-    TraceConsumer* consumer = ___cuprof_trace_manager.getConsumer(device);
-    kernel_trace_arg_t* arg = (kernel_trace_arg_t*) malloc(sizeof(kernel_trace_arg_t));
-    if (arg == nullptr) {
-        fprintf(stderr, "Unable to allocate memory!\n");
-        abort();
+  static void ___cuprof_marker(uint32_t kind, const char* name) {
+    uint64_t payload[HOSTREC_MARKER_UNIT] = {monotonic_ns(), kind};
+    strncpy((char*)(payload + 2), name, HOSTREC_MARKER_NAME_MAX);
+    ___cuprof_trace_manager.pushEvent(HOSTREC_MARKER, payload, HOSTREC_MARKER_UNIT);
+  }
+
+  int cuprofStart(void) {
+    {
+      std::lock_guard<std::mutex> lock(controlMutex());
+      controlTable()[CONTROL_ENABLED] = 1;
+      ___cuprof_control_update();
+    }
+    ___cuprof_marker(MARKER_KIND_START, "");
+    return 0;
+  }
+
+  int cuprofStop(void) {
+    {
+      std::lock_guard<std::mutex> lock(controlMutex());
+      controlTable()[CONTROL_ENABLED] = 0;
+      ___cuprof_control_update();
+    }
+    ___cuprof_marker(MARKER_KIND_STOP, "");
+    return 0;
+  }
+
+  int cuprofFlush(void) {
+    return ___cuprof_trace_manager.flush() ? 0 : -1;
+  }
+
+  int cuprofDump(void) {
+    return ___cuprof_trace_manager.dump() ? 0 : -1;
+  }
+
+  int cuprofSetFilter(const char* const* kernel_names, unsigned int count) {
+    if (count != 0 && !kernel_names)
+      return -1;
+    kernelsFetch();
+
+    // all kernels of the names, as static kernels of different
+    // modules may share a name
+    uint32_t kernids[KERNEL_FILTER_MAX];
+    uint32_t kernid_count = 0;
+    for (unsigned int i = 0; i < count; i++) {
+      bool found = false;
+      for (uint32_t kernid = 1; kernid <= kernels_fetched; kernid++) {
+        if (kernelInfo(kernid).name != kernel_names[i])
+          continue;
+        if (kernid_count == KERNEL_FILTER_MAX)
+          return -1;
+        kernids[kernid_count++] = kernid;
+        found = true;
       }
-    
-    *arg = (kernel_trace_arg_t){kernel_name, grid_dim, cta_size, device};
-    cudaChecked(cudaStreamAddCallback(stream, ___cuprof_trace_start_callback, (void*)arg, 0));
+      if (!found)
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(controlMutex());
+    uint32_t* table = controlTable();
+    table[CONTROL_KERNEL_COUNT] = kernid_count;
+    memcpy(table + CONTROL_KERNELS, kernids, kernid_count * sizeof(uint32_t));
+    ___cuprof_control_update();
+    return 0;
   }
 
-  void ___cuprof_trace_stop(int device, cudaStream_t stream) {
-    return;
-    
-    int* arg = (int*) malloc(sizeof(int));
-    if (arg == nullptr) {
-      fprintf(stderr, "Unable to allocate memory!\n");
-      abort();
+  int cuprofSetLaunchSampling(const cuprof_launch_sampling_t* policy) {
+    std::lock_guard<std::mutex> lock(controlMutex());
+    launch_sampling_t& sampling = launchSampling();
+    sampling = launch_sampling_t();
+    if (policy) {
+      sampling.first = policy->first;
+      sampling.every = policy->every;
+      sampling.from = policy->from;
+      sampling.to = policy->to;
     }
+    return 0;
+  }
+
+  int cuprofMarker(const char* name) {
+    if (!name)
+      return -1;
     
-    *arg = device;
-    cudaChecked(cudaStreamAddCallback(stream, ___cuprof_trace_stop_callback, (void*)arg, 0));
+    ___cuprof_marker(MARKER_KIND_USER, name);
+    return 0;
   }
-*/
+
+
 }
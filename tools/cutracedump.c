@@ -5,6 +5,32 @@
  **  [Kernel call]
  **  K <kernel_name>
  **
+ **  [Kernel launch] (host_time: enqueue time)
+ **  L <kernel_name> <launch_seq> <grid_x>/<grid_y>/<grid_z>
+ **    <cta_x>/<cta_y>/<cta_z> <shared_mem> <stream> <host_time>
+ **
+ **  [Marker] (cuprofMarker, cuprofStart, cuprofStop)
+ **  N <kind> <host_time> <name>
+ **
+ **  [Clock calibration]
+ **  C <gpu_time> <host_time>
+ **
+ **  [Aggregation] (one line per instruction; instruction_id 0: kernel total)
+ **  A <kernel_name> <instruction_id> <requests> <accesses> <sectors> <bytes>
+ **    <requests_with_1_active_lane> ... <requests_with_32_active_lanes>
+ **
+ **  [Device memory allocation] (free: size and id of the freed allocation)
+ **  B <kind> <allocation_id> <base> <size> <call_site> <host_time>
+ **
+ **  [Memory transfer / set] (<value> instead of <src> for memsets)
+ **  X <kind> <direction> <dst> <src> <size> <stream> <host_begin> <host_end>
+ **
+ **  [Sampling rate change] (following memory accesses are kept 1 in divisor)
+ **  R <host_time> <divisor>
+ **
+ **  [Kernel stats] (one line per kernel launch)
+ **  P <kernel_name> <stall_time> <stall_count>
+ **
  **  [Thread scheduling]
  **  T <operation> <sm_id> <cta_size> <cta_id_x> <cta_id_y> <cta_id_z> <warp_id> <clock>
  **
@@ -15,6 +41,14 @@
  **    <instruction_line_in_src> <instruction_col_in_src>
  **    <filename_of_src> <filename_of_src (If filename contains the space char ' ')> ...
  **
+ **  [Memory access, sector mode]
+ **  S <operation> <sm_id> <cta_size> <cta_id_x> <cta_id_y> <cta_id_z> <warp_id> <clock>
+ **    <request_size> <sector_count>
+ **    <sector_address(1)>/<lanes(1)> ... <sector_address(sector_count)>/<lanes(sector_count)>
+ **    <instruction_id> <kernel_name_for_instruction_id>
+ **    <instruction_line_in_src> <instruction_col_in_src>
+ **    <filename_of_src> ...
+ **
  **/
 
 #define WARP_SIZE 32
@@ -46,11 +80,49 @@ const char* OP_TYPE_NAMES[] = {
   "??"  // Undefined
 };
 
+// <kind> of allocations
+const char* ALLOC_KIND_NAMES[] = {
+  "MALLOC",       // cudaMalloc
+  "MANAGED",      // cudaMallocManaged
+  "MALLOC_ASYNC", // cudaMallocAsync
+  "FREE",         // cudaFree
+  "FREE_ASYNC",   // cudaFreeAsync
+  
+  "??"            // Undefined
+};
+
+// <kind> / <direction> of memory transfers
+const char* MEMOP_KIND_NAMES[] = {
+  "MEMCPY",        // cudaMemcpy(Async)
+  "MEMCPY_2D",     // cudaMemcpy2D(Async)
+  "MEMCPY_SYMBOL", // cudaMemcpy{To,From}Symbol(Async)
+  "MEMSET",        // cudaMemset(Async)
+  
+  "??"             // Undefined
+};
+const char* MEMOP_DIR_NAMES[] = {
+  "HtoH", "HtoD", "DtoH", "DtoD", "default", "-",
+  
+  "??"             // Undefined
+};
+
+const char* MARKER_KIND_NAMES[] = {
+  "USER",         // cuprofMarker
+  "START",        // cuprofStart
+  "STOP",         // cuprofStop
+  
+  "??"            // Undefined
+};
+
 void usage(const char* program_name) {
   fprintf(stderr, "Usage: %s [trace_file]\n", program_name);
   fprintf(stderr, "\n");
   fprintf(stderr, "If a file is provided, reads a binary memory trace from it and\n");
   fprintf(stderr, "dumps it to stdout. If no file is provided, uses stdin.\n");
+  fprintf(stderr, "A trace_file of unix:<path> listens on the Unix domain socket\n");
+  fprintf(stderr, "<path> and dumps the trace streamed to it by the application.\n");
+  fprintf(stderr, "A trace_file of shm:<name> attaches read-only to the shared\n");
+  fprintf(stderr, "memory ring <name> and dumps the trace published to it.\n");
 }
 
 int main(int argc, char** argv) {
@@ -78,19 +150,149 @@ int main(int argc, char** argv) {
     die("%s", trace_last_error);
   }
 
-  uint16_t cta_size = 0;
-  cta_t grid_dim = {0};
-
   while (trace_next(trace) == 0) {
 
     trace_record_t* record = &trace->record;
     if (quiet) {
       continue;
     }
+
+    // print host records
+    if (trace->hostrec.type != HOSTREC_NONE) {
+      switch (trace->hostrec.type) {
+      case HOSTREC_CLOCK_CALIB:
+        printf("C %" PRIu64 " %" PRIu64 "\n",
+               trace->clock_calib.gpu_time, trace->clock_calib.host_time);
+        break;
+
+      case HOSTREC_AGGREGATE: {
+        trace_aggregate_t agg;
+        if (trace_get_aggregate(trace, &agg) != 0) {
+          break;
+        }
+        const char* kernel_name =
+          trace_kernel_info(trace, agg.kernid)->kernel_name;
+        
+        for (uint64_t i = 0; i <= agg.insts_count; i++) {
+          const uint64_t* entry = agg.entries + i * AGG_ENTRY_UNIT;
+          printf("A %s %" PRIu64
+                 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64,
+                 kernel_name, i,
+                 entry[AGG_REQUESTS], entry[AGG_ACCESSES],
+                 entry[AGG_SECTORS], entry[AGG_BYTES]);
+          for (int lanes = 0; lanes < 32; lanes++) {
+            printf(" %" PRIu64, entry[AGG_LANE_HIST + lanes]);
+          }
+          printf("\n");
+        }
+        break;
+      }
+
+      case HOSTREC_ALLOC: {
+        const trace_alloc_t* alloc = &trace->alloc_event;
+        uint32_t kind = alloc->kind <= ALLOC_KIND_FREE_ASYNC ?
+          alloc->kind : ALLOC_KIND_FREE_ASYNC + 1;
+        printf("B %s %" PRId64 " %" PRIx64 " %" PRIu64 " %" PRIx64 " %" PRIu64 "\n",
+               ALLOC_KIND_NAMES[kind], (int64_t) alloc->id,
+               alloc->base, alloc->size, alloc->call_site, alloc->host_time);
+        break;
+      }
+
+      case HOSTREC_MEMOP: {
+        trace_memop_t memop;
+        if (trace_get_memop(trace, &memop) != 0) {
+          break;
+        }
+        uint32_t kind = memop.kind <= MEMOP_KIND_MEMSET ?
+          memop.kind : MEMOP_KIND_MEMSET + 1;
+        uint32_t dir = memop.direction <= MEMOP_DIR_NONE ?
+          memop.direction : MEMOP_DIR_NONE + 1;
+        printf("X %s %s %" PRIx64 " %" PRIx64 " %" PRIu64 " %" PRIx64
+               " %" PRIu64 " %" PRIu64 "\n",
+               MEMOP_KIND_NAMES[kind], MEMOP_DIR_NAMES[dir],
+               memop.dst, memop.src, memop.size, memop.stream,
+               memop.host_begin, memop.host_end);
+        break;
+      }
+
+      case HOSTREC_KERNEL:
+        printf("K %s\n", trace_kernel_info(
+                 trace, ((const uint64_t*)trace->hostrec.payload)[0])->kernel_name);
+        break;
+
+      case HOSTREC_LAUNCH: {
+        trace_launch_t launch;
+        if (trace_get_launch(trace, &launch) != 0) {
+          break;
+        }
+        printf("L %s %" PRIu64
+               " %" PRIu32 "/%" PRIu16 "/%" PRIu16
+               " %" PRIu32 "/%" PRIu16 "/%" PRIu16
+               " %" PRIu64 " %" PRIx64 " %" PRIu64 "\n",
+               trace_kernel_info(trace, launch.kernid)->kernel_name, launch.seq,
+               launch.grid_dim.x, launch.grid_dim.y, launch.grid_dim.z,
+               launch.cta_dim.x, launch.cta_dim.y, launch.cta_dim.z,
+               launch.shared_mem, launch.stream, launch.host_time);
+        break;
+      }
+
+      case HOSTREC_MARKER: {
+        trace_marker_t marker;
+        if (trace_get_marker(trace, &marker) != 0) {
+          break;
+        }
+        uint32_t kind = marker.kind <= MARKER_KIND_STOP ?
+          marker.kind : MARKER_KIND_STOP + 1;
+        printf("N %s %" PRIu64 " %s\n",
+               MARKER_KIND_NAMES[kind], marker.host_time, marker.name);
+        break;
+      }
+
+      case HOSTREC_LAUNCH_SAMPLING: {
+        trace_launch_sampling_t sampling;
+        if (trace_get_launch_sampling(trace, &sampling) != 0) {
+          break;
+        }
+        printf("Q %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+               " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+               trace_kernel_info(trace, sampling.kernid)->kernel_name,
+               sampling.launches, sampling.skipped,
+               sampling.first, sampling.every, sampling.from, sampling.to,
+               sampling.host_time);
+        break;
+      }
+
+      case HOSTREC_SAMPLING:
+        printf("R %" PRIu64 " %" PRIu32 "\n",
+               ((const uint64_t*)trace->hostrec.payload)[0], trace->sampling_div);
+        break;
+
+      case HOSTREC_KERNEL_STAT: {
+        trace_kernel_stat_t kstat;
+        if (trace_get_kernel_stat(trace, &kstat) != 0) {
+          break;
+        }
+        printf("P %s %" PRIu64 " %" PRIu64 "\n",
+               trace_kernel_info(trace, kstat.kernid)->kernel_name,
+               kstat.stall_ns, kstat.stall_count);
+        break;
+      }
+        
+      default:
+        break;
+      }
+      continue;
+    }
       
     const trace_header_kernel_t* kernel_info = record->kernel_info;
     const trace_header_inst_t* inst_info = record->inst_info;
 
+    // dims of the latest launch of the kernel
+    const trace_launch_t* launch = trace_kernel_launch(trace, record->kernid);
+    cta_t grid_dim = launch->grid_dim;
+    uint16_t cta_size = (uint16_t)
+      (launch->cta_dim.x * launch->cta_dim.y * launch->cta_dim.z);
+
     char trace_type;
     switch(inst_info->type) {
     case RECORD_EXECUTE:
@@ -108,6 +310,9 @@ int main(int argc, char** argv) {
       trace_type = '?';
       break;
     }
+    if (record->kind == RECORD_KIND_SECTOR) {
+      trace_type = 'S';
+    }
       
         
       
@@ -119,7 +324,7 @@ int main(int argc, char** argv) {
            " %" PRIu32
            " %" PRIu16
            " %" PRIu32 " %" PRIu32
-           " %010" PRIu32,
+           " %020" PRIu64,
            trace_type, OP_TYPE_NAMES[inst_info->type],
            record->grid,
            record->ctaid.x, grid_dim.x,
@@ -150,6 +355,18 @@ int main(int argc, char** argv) {
       }
 
     }
+
+    // print unique sectors
+    else if (trace_type == 'S') {
+      
+      printf(" %" PRIu64 " %" PRIu32, inst_info->meta[0], record->sector_count);
+      
+      for (uint32_t i = 0; i < record->sector_count; i++) {
+        printf(" %" PRIx64 "/%" PRIu64,
+               (uint64_t) RECORD_GET_SECTOR_ADDR(record->sectors[i]),
+               (uint64_t) RECORD_GET_SECTOR_LANES(record->sectors[i]));
+      }
+    }
     
 
     // inst id
@@ -10,6 +10,70 @@ $1=="K" \
         printf "trace_type=" $1 " kernel=" $2 "\n";
 }
 
+$1=="L" \
+{
+        printf "trace_type=" $1 " kernel=" $2 " launch_seq=" $3 \
+        " grid=" $4 " cta=" $5 " shared_mem=" $6 " stream=" $7 \
+        " host_time=" $8 "\n";
+}
+
+$1=="N" \
+{
+        printf "trace_type=" $1 " kind=" $2 " host_time=" $3 " name=\"";
+        for (i = 4; i <= NF; i++)
+        {
+                printf (i > 4 ? " " : "") $i;
+        }
+        printf "\"\n";
+}
+
+$1=="Q" \
+{
+        printf "trace_type=" $1 " kernel=" $2 " launches=" $3 " skipped=" $4 \
+        " first=" $5 " every=" $6 " from=" $7 " to=" $8 " host_time=" $9 "\n";
+}
+
+$1=="C" \
+{
+        printf "trace_type=" $1 " gpu_time=" $2 " host_time=" $3 "\n";
+}
+
+$1=="A" \
+{
+        printf "trace_type=" $1 " kernel=" $2 " inst_id=" $3 \
+        " requests=" $4 " accesses=" $5 " sectors=" $6 " bytes=" $7;
+
+        for (i = 8; i <= NF; i++)
+        {
+                printf " lanes[" i-7 "]=" $i;
+        }
+        printf "\n";
+}
+
+$1=="B" \
+{
+        printf "trace_type=" $1 " kind=" $2 " alloc_id=" $3 \
+        " base=" $4 " size=" $5 " call_site=" $6 " host_time=" $7 "\n";
+}
+
+$1=="X" \
+{
+        printf "trace_type=" $1 " kind=" $2 " direction=" $3 \
+        " dst=" $4 " src=" $5 " size=" $6 " stream=" $7 \
+        " host_begin=" $8 " host_end=" $9 "\n";
+}
+
+$1=="R" \
+{
+        printf "trace_type=" $1 " host_time=" $2 " divisor=" $3 "\n";
+}
+
+$1=="P" \
+{
+        printf "trace_type=" $1 " kernel=" $2 \
+        " stall_time=" $3 " stall_count=" $4 "\n";
+}
+
 $1=="T" \
 {
         printf "trace_type=" $1 " op=" $2 " grid=" $3 \
@@ -18,6 +82,31 @@ $1=="T" \
         " sm=" $9 " warpp=" $10 " clock=" $11 "\n";
 }
 
+$1=="S" \
+{
+        printf "trace_type=" $1 " op=" $2 " grid=" $3 \
+        " cta[x]=" $4 " cta[y]=" $5 " cta[z]=" $6 \
+        " warpv=" $7 " cta_size=" $8 \
+        " sm=" $9 " warpp=" $10 " clock=" $11 \
+        " req_size=" $12 " sector_count=" $13;
+
+        n = 14 + $13;
+        for (i = 14; i < n; i++)
+        {
+                split($i, sector, "/");
+                printf " sector[" i-14 "]=" sector[1] " lanes[" i-14 "]=" sector[2];
+        }
+
+        printf " inst_id=" $n " kernel_name=" $(n+1) " inst_line=" $(n+2) " inst_col=" $(n+3);
+
+        printf " inst_src=\"";
+        for (i = n+4; i < NF; i++)
+        {
+                printf $i" ";
+        }
+        printf $i"\"\n"
+}
+
 $1=="M" \
 {
         printf "trace_type=" $1 " op=" $2 " grid=" $3 \